@@ -13,77 +13,142 @@
 #include <streambuf>
 #include <fstream>
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <unordered_map>
+#include <array>
+#include <utility>
+#include <type_traits>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include "portable_endian.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MINITAR_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <cstring>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <climits>
+#endif
+
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
+
 using namespace std;
 
 namespace minitar {
     string const magic= "MINITAR";
 
+    // the FilePerm bits are the posix bits, and so are the std::filesystem
+    // ones, which turns the conversions into a mask
+    constexpr uint16_t perm_mask= 07777;
+
+    static_assert(static_cast<uint16_t>(FilePerm::owner_read) == static_cast<uint16_t>(filesystem::perms::owner_read));
+    static_assert(static_cast<uint16_t>(FilePerm::owner_write) == static_cast<uint16_t>(filesystem::perms::owner_write));
+    static_assert(static_cast<uint16_t>(FilePerm::owner_exec) == static_cast<uint16_t>(filesystem::perms::owner_exec));
+    static_assert(static_cast<uint16_t>(FilePerm::group_read) == static_cast<uint16_t>(filesystem::perms::group_read));
+    static_assert(static_cast<uint16_t>(FilePerm::group_write) == static_cast<uint16_t>(filesystem::perms::group_write));
+    static_assert(static_cast<uint16_t>(FilePerm::group_exec) == static_cast<uint16_t>(filesystem::perms::group_exec));
+    static_assert(static_cast<uint16_t>(FilePerm::others_read) == static_cast<uint16_t>(filesystem::perms::others_read));
+    static_assert(static_cast<uint16_t>(FilePerm::others_write) == static_cast<uint16_t>(filesystem::perms::others_write));
+    static_assert(static_cast<uint16_t>(FilePerm::others_exec) == static_cast<uint16_t>(filesystem::perms::others_exec));
+    static_assert(static_cast<uint16_t>(FilePerm::set_uid) == static_cast<uint16_t>(filesystem::perms::set_uid));
+    static_assert(static_cast<uint16_t>(FilePerm::set_gid) == static_cast<uint16_t>(filesystem::perms::set_gid));
+    static_assert(static_cast<uint16_t>(FilePerm::sticky_bit) == static_cast<uint16_t>(filesystem::perms::sticky_bit));
+
     filesystem::perms perms_of_uint16(uint16_t data) {
-        namespace fs= filesystem;
-        auto perms= fs::perms::none;
-        if (data & static_cast<uint16_t>(FilePerm::none))
-            perms |= fs::perms::none;
-        if (data & static_cast<uint16_t>(FilePerm::owner_read))
-            perms |= fs::perms::owner_read;
-        if (data & static_cast<uint16_t>(FilePerm::owner_write))
-            perms |= fs::perms::owner_write;
-        if (data & static_cast<uint16_t>(FilePerm::owner_exec))
-            perms |= fs::perms::owner_exec;
-        if (data & static_cast<uint16_t>(FilePerm::group_read))
-            perms |= fs::perms::group_read;
-        if (data & static_cast<uint16_t>(FilePerm::group_write))
-            perms |= fs::perms::group_write;
-        if (data & static_cast<uint16_t>(FilePerm::group_exec))
-            perms |= fs::perms::group_exec;
-        if (data & static_cast<uint16_t>(FilePerm::others_read))
-            perms |= fs::perms::others_read;
-        if (data & static_cast<uint16_t>(FilePerm::others_write))
-            perms |= fs::perms::others_write;
-        if (data & static_cast<uint16_t>(FilePerm::others_exec))
-            perms |= fs::perms::others_exec;
-        if (data & static_cast<uint16_t>(FilePerm::set_uid))
-            perms |= fs::perms::set_uid;
-        if (data & static_cast<uint16_t>(FilePerm::set_gid))
-            perms |= fs::perms::set_gid;
-        if (data & static_cast<uint16_t>(FilePerm::sticky_bit))
-            perms |= fs::perms::sticky_bit;
-        return perms;
+        return static_cast<filesystem::perms>(data & perm_mask);
     }
 
     uint16_t uint16_of_perms(filesystem::perms perms) {
-        namespace fs= filesystem;
-        uint16_t data= 0;
-        if ((perms & fs::perms::none) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::none);
-        if ((perms & fs::perms::owner_read) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::owner_read);
-        if ((perms & fs::perms::owner_write) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::owner_write);
-        if ((perms & fs::perms::owner_exec) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::owner_exec);
-        if ((perms & fs::perms::group_read) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::group_read);
-        if ((perms & fs::perms::group_write) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::group_write);
-        if ((perms & fs::perms::group_exec) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::group_exec);
-        if ((perms & fs::perms::others_read) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::others_read);
-        if ((perms & fs::perms::others_write) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::others_write);
-        if ((perms & fs::perms::others_exec) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::others_exec);
-        if ((perms & fs::perms::set_uid) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::set_uid);
-        if ((perms & fs::perms::set_gid) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::set_gid);
-        if ((perms & fs::perms::sticky_bit) != fs::perms::none)
-            data |= static_cast<uint16_t>(FilePerm::sticky_bit);
-        return data;
+        return static_cast<uint16_t>(perms) & perm_mask;
+    }
+
+    // little endian fixed-width fields, copied with memcpy so that records
+    // don't need to be aligned, which compiles to a single load or store
+    template<typename T>
+    T load_le(void const * source) {
+        static_assert(is_unsigned_v<T>);
+        T value;
+        memcpy(&value, source, sizeof(T));
+        if constexpr (sizeof(T) == 2) {
+            return le16toh(value);
+        } else if constexpr (sizeof(T) == 4) {
+            return le32toh(value);
+        } else if constexpr (sizeof(T) == 8) {
+            return le64toh(value);
+        } else {
+            return value;
+        }
+    }
+
+    template<typename T>
+    void* store_le(T value, void* target) {
+        static_assert(is_unsigned_v<T>);
+        if constexpr (sizeof(T) == 2) {
+            value= htole16(value);
+        } else if constexpr (sizeof(T) == 4) {
+            value= htole32(value);
+        } else if constexpr (sizeof(T) == 8) {
+            value= htole64(value);
+        }
+        memcpy(target, &value, sizeof(T));
+        return static_cast<uint8_t*>(target) + sizeof(T);
     }
 
+    // a run of adjacent fixed-width fields of a record, decoded or encoded
+    // in one go with the field offsets computed at compile time
+    template<typename ... Ts>
+    struct fields {
+        static constexpr std::size_t size= (sizeof(Ts) + ...);
+        static constexpr array<std::size_t, sizeof...(Ts)> offsets= [] {
+            array<std::size_t, sizeof...(Ts)> acc{};
+            std::size_t const sizes[]= { sizeof(Ts)... };
+            std::size_t at= 0;
+            for (std::size_t i= 0; i < sizeof...(Ts); i++) {
+                acc[i]= at;
+                at+= sizes[i];
+            }
+            return acc;
+        }();
+
+        // the values followed by the pointer past them, for tie
+        static tuple<Ts..., void const *> load(void const * source) {
+            auto ptr= static_cast<uint8_t const *>(source);
+            return load_aux(ptr, index_sequence_for<Ts...>());
+        }
+
+        static void* store(void* target, Ts ... values) {
+            store_aux(static_cast<uint8_t*>(target), index_sequence_for<Ts...>(), values...);
+            return static_cast<uint8_t*>(target) + size;
+        }
+
+    private:
+        template<std::size_t ... Is>
+        static tuple<Ts..., void const *> load_aux(uint8_t const * ptr, index_sequence<Is...>) {
+            return tuple<Ts..., void const *>(load_le<Ts>(ptr + offsets[Is])..., ptr + size);
+        }
+
+        template<std::size_t ... Is>
+        static void store_aux(uint8_t* ptr, index_sequence<Is...>, Ts ... values) {
+            (store_le<Ts>(values, ptr + offsets[Is]), ...);
+        }
+    };
+
     pair<string, void const *> read_string(void const * source, uint64_t len) {
         auto ptr= static_cast<char const *>(source);
         return pair(string(ptr, len), ptr+len);
@@ -95,18 +160,18 @@ namespace minitar {
     }
 
     pair<uint16_t, void const *> read_uint16(void const * source) {
-        auto ptr= static_cast<uint16_t const *>(source);
-        return pair(le16toh(*ptr), ptr+1);
+        auto ptr= static_cast<uint8_t const *>(source);
+        return pair(load_le<uint16_t>(ptr), ptr+sizeof(uint16_t));
     }
 
     pair<uint32_t, void const *> read_uint32(void const * source) {
-        auto ptr= static_cast<uint32_t const *>(source);
-        return pair(le32toh(*ptr), ptr+1);
+        auto ptr= static_cast<uint8_t const *>(source);
+        return pair(load_le<uint32_t>(ptr), ptr+sizeof(uint32_t));
     }
 
     pair<uint64_t, void const *> read_uint64(void const * source) {
-        auto ptr= static_cast<uint64_t const *>(source);
-        return pair(le64toh(*ptr), ptr+1);
+        auto ptr= static_cast<uint8_t const *>(source);
+        return pair(load_le<uint64_t>(ptr), ptr+sizeof(uint64_t));
     }
 
     pair<v1::action, void const *> read_action(void const * source) {
@@ -115,50 +180,38 @@ namespace minitar {
     }
 
     pair<filesystem::perms, void const *> read_perms(void const * source) {
-        auto ptr= static_cast<uint16_t const *>(source);
-        return pair(perms_of_uint16(le16toh(*ptr)), ptr+1);
+        auto ptr= static_cast<uint8_t const *>(source);
+        return pair(perms_of_uint16(load_le<uint16_t>(ptr)), ptr+sizeof(uint16_t));
     }
 
     void* write_uint8(uint8_t value, void* target) {
-        auto ptr= static_cast<uint8_t*>(target);
-        *ptr= value;
-        return ptr+1;
+        return store_le(value, target);
     }
 
     void* write_uint16(uint16_t value, void* target) {
-        auto ptr= static_cast<uint16_t*>(target);
-        *ptr= htole16(value);
-        return ptr+1;
+        return store_le(value, target);
     }
 
     void* write_uint32(uint32_t value, void* target) {
-        auto ptr= static_cast<uint32_t*>(target);
-        *ptr= htole32(value);
-        return ptr+1;
+        return store_le(value, target);
     }
 
     void* write_uint64(uint64_t value, void* target) {
-        auto ptr= static_cast<uint64_t*>(target);
-        *ptr= htole64(value);
-        return ptr+1;
+        return store_le(value, target);
     }
 
-    void* write_string(string value, void* target) {
+    void* write_string(string const & value, void* target) {
         auto ptr= static_cast<char*>(target);
         value.copy(ptr, value.length());
         return ptr+value.length();
     }
 
     void* write_action(v1::action value, void* target) {
-        auto ptr= static_cast<uint8_t*>(target);
-        *ptr= static_cast<uint8_t>(value);
-        return ptr+1;
+        return store_le(static_cast<uint8_t>(value), target);
     }
 
     void* write_perms(filesystem::perms value, void* target) {
-        auto ptr= static_cast<uint16_t*>(target);
-        *ptr= htole16(uint16_of_perms(value));
-        return ptr+1;
+        return store_le(uint16_of_perms(value), target);
     }
 
     using strlen_t= uint32_t;
@@ -170,18 +223,206 @@ namespace minitar {
     };
     template<class... Ts> Overload(Ts...) -> Overload<Ts...>;
 
+    // runs job(0) .. job(count-1) on up to max_workers threads, the first
+    // exception thrown by a job is rethrown once all the workers are done
+    void parallel_for(size_t count, size_t max_workers, function<void(size_t)> const & job) {
+        auto workers= min<size_t>({count, max_workers, max(thread::hardware_concurrency(), 1u)});
+        atomic<size_t> next= 0;
+        exception_ptr error;
+        mutex error_lock;
+        auto work= [&]() {
+            for (auto i= next++; i < count; i= next++) {
+                try {
+                    job(i);
+                } catch (...) {
+                    lock_guard<mutex> guard(error_lock);
+                    if (!error) {
+                        error= current_exception();
+                    }
+                }
+            }
+        };
+
+        vector<thread> pool;
+        for (size_t i= 1; i < workers; i++) {
+            pool.emplace_back(work);
+        }
+        work();
+        for (auto & worker: pool) {
+            worker.join();
+        }
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
 }
 
 namespace minitar::v1 {
 
     using touch_header= uint64_t;
     using touche_headers= std::list<touch_header>;
-    using touche_contents= std::list<std::string>;
+    using touche_contents= std::list<std::string const *>;
+    // the sizes of contents left on disk, for the files of a tree walked
+    // without reading them
+    using content_sizes= std::unordered_map<touch const *, uint64_t>;
+
+    struct walked_dir;
+
+    // a walk leaving the contents on disk: it keeps their sizes for the
+    // header, and reports every file found, in the order of the header, with
+    // its directory
+    struct deferred_contents {
+        content_sizes sizes;
+        function<void(touch const & touch, shared_ptr<walked_dir const> const & dir, uint64_t size)> found;
+    };
+
+    uint8_t const version_plain= 1;
+    uint8_t const version_metadata= 2;
+
+    // fixed parts of the records, following the action byte and the name
+    //   version 1: MKDIR perm, TOUCH perm size, SLINK perm target_len
+    //   version 2: the metadata block is inserted right after perm
+    using perm_fields= fields<uint16_t>;
+    using touch_fields= fields<uint16_t, uint64_t>;
+    using slink_fields= fields<uint16_t, strlen_t>;
+    // mtime_sec mtime_nsec uid gid xattr_count, after the presence flag
+    using metadata_fields= fields<uint64_t, uint32_t, uint32_t, uint32_t, uint32_t>;
+
+    pair<optional<metadata>, void const *> read_metadata(void const * source) {
+        auto ptr= source;
+        uint8_t present;
+        tie(present, ptr)= read_uint8(ptr);
+        if (!present) {
+            return pair(optional<metadata>(), ptr);
+        }
+        metadata meta;
+        uint64_t sec;
+        uint32_t count;
+        tie(sec, meta.mtime_nsec, meta.uid, meta.gid, count, ptr)= metadata_fields::load(ptr);
+        meta.mtime_sec= static_cast<int64_t>(sec);
+        for (uint32_t i= 0; i < count; i++) {
+            strlen_t len;
+            pair<string, string> xattr;
+            tie(len, ptr)= read_uint32(ptr);
+            tie(xattr.first, ptr)= read_string(ptr, len);
+            tie(len, ptr)= read_uint32(ptr);
+            tie(xattr.second, ptr)= read_string(ptr, len);
+            meta.xattrs.push_back(move(xattr));
+        }
+        return pair(optional(move(meta)), ptr);
+    }
+
+    void* write_metadata(optional<metadata> const & meta, void* target) {
+        auto ptr= target;
+        ptr= write_uint8(meta.has_value(), ptr);
+        if (meta.has_value()) {
+            ptr= metadata_fields::store(ptr, static_cast<uint64_t>(meta->mtime_sec),
+                meta->mtime_nsec, meta->uid, meta->gid, meta->xattrs.size());
+            for (auto const & [name, value]: meta->xattrs) {
+                ptr= write_uint32(name.length(), ptr);
+                ptr= write_string(name, ptr);
+                ptr= write_uint32(value.length(), ptr);
+                ptr= write_string(value, ptr);
+            }
+        }
+        return ptr;
+    }
+
+    size_t metadata_size(optional<metadata> const & meta) {
+        size_t acc= 1; // presence flag
+        if (meta.has_value()) {
+            acc+= metadata_fields::size;
+            for (auto const & [name, value]: meta->xattrs) {
+                acc+= sizeof(strlen_t) + name.length();
+                acc+= sizeof(strlen_t) + value.length();
+            }
+        }
+        return acc;
+    }
+
+    bool has_metadata(tar const & tar) {
+        for (auto const & element: tar) {
+            auto found= visit(Overload {
+                [](mkdir const & mkdir) {
+                    return mkdir.meta.has_value() || has_metadata(mkdir.children);
+                },
+                [](touch const & touch) { return touch.meta.has_value(); },
+                [](slink const & link) { return link.meta.has_value(); },
+            }, element);
+            if (found) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-    pair<tar, void const *> read_header_aux(touche_headers& touches, void const * data) {
+    void const * read_header_aux(tar & tar_acc, touche_headers& touches, void const * data, uint8_t version);
+
+    // decodes the record following its action byte into tar_acc in place,
+    // the nested directories are never copied
+    void const * read_record(v1::action action, tar & tar_acc, touche_headers& touches, void const * data, uint8_t version) {
         auto ptr= data;
+        auto with_meta= version >= version_metadata;
+
+        auto read_name= [&ptr]() {
+            strlen_t len;
+            string name;
+            tie(len, ptr)= read_uint32(ptr);
+            tie(name, ptr)= read_string(ptr, len);
+            return name;
+        };
 
-        tar tar_acc;
+        switch (action) {
+            case action::MKDIR: {
+                auto & dir= get<mkdir>(tar_acc.emplace_back(in_place_type<mkdir>));
+                uint16_t perm;
+                dir.name= read_name();
+                tie(perm, ptr)= perm_fields::load(ptr);
+                dir.perm= perms_of_uint16(perm);
+                if (with_meta) {
+                    tie(dir.meta, ptr)= read_metadata(ptr);
+                }
+                ptr= read_header_aux(dir.children, touches, ptr, version);
+                } break;
+            case action::TOUCH: {
+                auto & touch= get<v1::touch>(tar_acc.emplace_back(in_place_type<v1::touch>));
+                uint16_t perm;
+                touch_header touch_h;
+                touch.name= read_name();
+                if (with_meta) {
+                    tie(perm, ptr)= perm_fields::load(ptr);
+                    tie(touch.meta, ptr)= read_metadata(ptr);
+                    tie(touch_h, ptr)= read_uint64(ptr);
+                } else {
+                    tie(perm, touch_h, ptr)= touch_fields::load(ptr);
+                }
+                touch.perm= perms_of_uint16(perm);
+                touches.push_back(touch_h);
+                } break;
+            case action::SLINK: {
+                auto & link= get<slink>(tar_acc.emplace_back(in_place_type<slink>));
+                uint16_t perm;
+                strlen_t len;
+                link.name= read_name();
+                if (with_meta) {
+                    tie(perm, ptr)= perm_fields::load(ptr);
+                    tie(link.meta, ptr)= read_metadata(ptr);
+                    tie(len, ptr)= read_uint32(ptr);
+                } else {
+                    tie(perm, len, ptr)= slink_fields::load(ptr);
+                }
+                link.perm= perms_of_uint16(perm);
+                tie(link.target, ptr)= read_string(ptr, len);
+                } break;
+            default:
+                break;
+        }
+        return ptr;
+    }
+
+    void const * read_header_aux(tar & tar_acc, touche_headers& touches, void const * data, uint8_t version) {
+        auto ptr= data;
 
         do {
             v1::action action;
@@ -189,45 +430,214 @@ namespace minitar::v1 {
 
             switch (action) {
                 case action::EXIT: {
-                    return pair(tar_acc, ptr);
-                    } break;
-                case action::MKDIR: {
-                    strlen_t len;
-                    mkdir dir;
-                    tie(len, ptr)= read_uint32(ptr);
-                    tie(dir.name, ptr)= read_string(ptr, len);
-                    tie(dir.perm, ptr)= read_perms(ptr);
-                    tie(dir.children, ptr)= read_header_aux(touches, ptr);
-                    tar_acc.push_back(dir);
+                    return ptr;
                     } break;
                 case action::CDUP: {
-                    return pair(tar_acc, ptr);
+                    return ptr;
                     } break;
-                case action::TOUCH: {
-                    strlen_t len;
-                    touch touch;
-                    touch_header touch_h;
-                    tie(len, ptr)= read_uint32(ptr);
-                    tie(touch.name, ptr)= read_string(ptr, len);
-                    tie(touch.perm, ptr)= read_perms(ptr);
-                    tie(touch_h, ptr)= read_uint64(ptr);
-                    touches.push_back(touch_h);
-                    tar_acc.push_back(touch);
-                    } break;
-                case action::SLINK: {
-                    strlen_t len;
-                    slink link;
-                    tie(len, ptr)= read_uint32(ptr);
-                    tie(link.name, ptr)= read_string(ptr, len);
-                    tie(link.perm, ptr)= read_perms(ptr);
-                    tie(len, ptr)= read_uint32(ptr);
-                    tie(link.target, ptr)= read_string(ptr, len);
-                    tar_acc.push_back(link);
+                default: {
+                    ptr= read_record(action, tar_acc, touches, ptr, version);
                     } break;
             }
         } while(true);
     }
 
+    // a single path component: an entry naming its parent, or a path through
+    // another entry, as a symlink, would be written outside of the root
+    bool valid_name(char const * name, size_t len) {
+        string_view view(name, len);
+        return !view.empty() && view != "." && view != ".." && view.find_first_of(string_view("/\0", 2)) == string_view::npos;
+    }
+
+    // the records of a header located without decoding them, in archive
+    // order; the header format is length prefixed, every record position
+    // depends on the previous one, so this is a sequential skip-scan that
+    // touches only the length fields and allocates nothing per record
+    struct header_record {
+        uint64_t offset;          // of the action byte
+        uint64_t contents_before; // contents of the preceding touches
+        uint32_t parent;          // index of the enclosing MKDIR
+        v1::action action;
+    };
+
+    uint32_t const no_parent= UINT32_MAX;
+
+    struct header_skeleton {
+        uint8_t version;
+        vector<header_record> records;
+        uint64_t contents;      // offset of the contents
+        uint64_t contents_size;
+    };
+
+    // lengths no valid header holds, so that a corrupted one is told apart
+    // from one not arrived yet: names and symlink targets up to PATH_MAX, and
+    // the xattrs within the limits of linux
+    strlen_t const max_path= 4096;
+    strlen_t const max_xattr_name= 255;
+    strlen_t const max_xattr_value= 1 << 16;
+    uint32_t const max_xattrs= 1 << 15;
+
+    // bounds checked, so a truncated or corrupted header is rejected instead
+    // of read past its end. a header arriving from a stream is scanned as it
+    // comes: every call goes on from the last complete record, with data the
+    // beginning of the header and size the bytes arrived so far
+    class header_scanner {
+    public:
+        enum class result { complete, truncated, corrupt };
+
+        result scan(void const * data, uint64_t size) {
+            auto base= static_cast<uint8_t const *>(data);
+            uint64_t at= at_;
+            bool cut= false;
+            auto fits= [&at, &cut, size](uint64_t len) {
+                cut= len > size - at;
+                return !cut;
+            };
+            auto fail= [&cut]() {
+                return cut ? result::truncated : result::corrupt;
+            };
+            auto skip_string= [&at, &fits, base](strlen_t most, string_view * value= nullptr) {
+                if (!fits(sizeof(strlen_t))) {
+                    return false;
+                }
+                auto len= load_le<strlen_t>(base + at);
+                if (len > most) {
+                    return false;
+                }
+                at+= sizeof(strlen_t);
+                if (!fits(len)) {
+                    return false;
+                }
+                if (value != nullptr) {
+                    *value= string_view(reinterpret_cast<char const *>(base + at), len);
+                }
+                at+= len;
+                return true;
+            };
+            auto skip_metadata= [&at, &fits, &skip_string, base]() {
+                if (!fits(1)) {
+                    return false;
+                }
+                if (base[at++] == 0) {
+                    return true;
+                }
+                if (!fits(metadata_fields::size)) {
+                    return false;
+                }
+                auto count= load_le<uint32_t>(base + at + metadata_fields::offsets[4]);
+                if (count > max_xattrs) {
+                    return false;
+                }
+                at+= metadata_fields::size;
+                for (uint32_t i= 0; i < count; i++) {
+                    if (!skip_string(max_xattr_name) || !skip_string(max_xattr_value)) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            if (at == 0) {
+                if (!fits(magic.length() + 1)) {
+                    return fail();
+                }
+                if (memcmp(base, magic.data(), magic.length()) != 0) {
+                    return result::corrupt;
+                }
+                at+= magic.length();
+                skeleton_.version= base[at++];
+                if (skeleton_.version != version_plain && skeleton_.version != version_metadata) {
+                    return result::corrupt;
+                }
+            }
+            auto with_meta= skeleton_.version >= version_metadata;
+
+            do {
+                // the records before are complete, the next call resumes here
+                at_= at;
+                if (!fits(1)) {
+                    return fail();
+                }
+                auto action= static_cast<v1::action>(base[at]);
+                if (action == action::EXIT) {
+                    if (!parents_.empty()) {
+                        return result::corrupt;
+                    }
+                    at++;
+                    at_= at;
+                    skeleton_.contents= at;
+                    return result::complete;
+                }
+                if (action == action::CDUP) {
+                    if (parents_.empty()) {
+                        return result::corrupt;
+                    }
+                    parents_.pop_back();
+                    at++;
+                    continue;
+                }
+                if (action != action::MKDIR && action != action::TOUCH && action != action::SLINK) {
+                    return result::corrupt;
+                }
+
+                auto offset= at++;
+                string_view name;
+                if (!skip_string(max_path, &name)) {
+                    return fail();
+                }
+                if (!valid_name(name.data(), name.length())) {
+                    return result::corrupt;
+                }
+                if (!fits(sizeof(uint16_t))) {
+                    return fail();
+                }
+                at+= sizeof(uint16_t);
+                if (with_meta && !skip_metadata()) {
+                    return fail();
+                }
+                uint64_t content= 0;
+                if (action == action::TOUCH) {
+                    if (!fits(sizeof(uint64_t))) {
+                        return fail();
+                    }
+                    content= load_le<uint64_t>(base + at);
+                    at+= sizeof(uint64_t);
+                } else if (action == action::SLINK && !skip_string(max_path)) {
+                    return fail();
+                }
+
+                auto parent= parents_.empty() ? no_parent : parents_.back();
+                skeleton_.records.push_back({offset, skeleton_.contents_size, parent, action});
+                skeleton_.contents_size+= content;
+                if (action == action::MKDIR) {
+                    parents_.push_back(skeleton_.records.size() - 1);
+                }
+            } while (true);
+        }
+
+        // once scan is complete
+        header_skeleton & skeleton() { return skeleton_; }
+
+    private:
+        header_skeleton skeleton_{0, {}, 0, 0};
+        uint64_t at_= 0;
+        vector<uint32_t> parents_;
+    };
+
+    // the contents are required to follow the header
+    optional<header_skeleton> scan_header(void const * data, uint64_t size) {
+        optional<header_skeleton> empty;
+        header_scanner scanner;
+        if (scanner.scan(data, size) != header_scanner::result::complete) {
+            return empty;
+        }
+        auto & skeleton= scanner.skeleton();
+        if (skeleton.contents_size > size - skeleton.contents) {
+            return empty;
+        }
+        return move(skeleton);
+    }
+
     optional<tuple<tar, void const *, touche_headers>> read_header(void const * data) {
         optional<tuple<tar, void*, touche_headers>> const empty;
         auto ptr= data;
@@ -240,14 +650,14 @@ namespace minitar::v1 {
 
         uint8_t version;
         tie(version, ptr)= read_uint8(ptr);
-        if (version != 1) {
+        if (version != version_plain && version != version_metadata) {
             return empty;
         }
 
         touche_headers touches;
         tar header;
-        tie(header, ptr)= read_header_aux(touches, ptr);
-        return tuple(header, ptr, touches);
+        ptr= read_header_aux(header, touches, ptr, version);
+        return tuple(move(header), ptr, move(touches));
     }
 
     void const * read_data_aux(tar& tar_acc, touche_headers& touches, void const * data) {
@@ -272,20 +682,19 @@ namespace minitar::v1 {
     }
 
     pair<tar, void const *> read_data(tar header, touche_headers header_touches, void const * data) {
-        tar tar= header;
-        touche_headers touches= header_touches;
+        tar tar= move(header);
+        touche_headers touches= move(header_touches);
 
         auto ptr= read_data_aux(tar, touches, data);
-        return pair(tar, (void const *)ptr);
+        return pair(move(tar), (void const *)ptr);
     }
 
     optional<pair<tar, void const *>> unmarshal(void const * data) {
         optional<pair<tar,void const *>> empty;
         auto header= read_header(data);
         if (header.has_value()) {
-            auto [tar, ptr, touches]= header.value();
-            tie(tar, ptr)= read_data(tar, touches, ptr);
-            return pair(tar, ptr);
+            auto & [tar, ptr, touches]= header.value();
+            return read_data(move(tar), move(touches), ptr);
         } else {
             return empty;
         }
@@ -386,7 +795,517 @@ namespace minitar::v1 {
 
     namespace fs= filesystem;
 
-    tar read_fs_tree_aux(fs::path const & root) {
+#if defined(MINITAR_POSIX)
+    // owns a file descriptor, so that errors thrown in the middle of a walk
+    // don't leak it
+    struct fd_guard {
+        int fd;
+
+        explicit fd_guard(int fd= -1) : fd(fd) {}
+        fd_guard(fd_guard const &)= delete;
+        fd_guard & operator=(fd_guard const &)= delete;
+        ~fd_guard() {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        int get() const { return fd; }
+        int release() {
+            auto released= fd;
+            fd= -1;
+            return released;
+        }
+    };
+
+    fs::filesystem_error posix_error(char const * what, fs::path const & path) {
+        return fs::filesystem_error(what, path, error_code(errno, generic_category()));
+    }
+
+    fs::perms perms_of_mode(mode_t mode) {
+        return static_cast<fs::perms>(mode & 07777);
+    }
+
+    mode_t mode_of_perms(fs::perms perm) {
+        return static_cast<mode_t>(perm) & 07777;
+    }
+
+#if defined(__linux__)
+    // the path of an entry relative to an opened directory, used for the
+    // calls that have no *at variant
+    string proc_path_at(int dirfd, char const * name) {
+        return "/proc/self/fd/" + to_string(dirfd) + "/" + name;
+    }
+
+    template<typename Lister, typename Getter>
+    list<pair<string, string>> read_xattrs(Lister list_names, Getter get_value) {
+        list<pair<string, string>> xattrs;
+        auto len= list_names(nullptr, 0);
+        if (len <= 0) {
+            return xattrs;
+        }
+        string names(len, '\0');
+        len= list_names(names.data(), names.length());
+        if (len <= 0) {
+            return xattrs;
+        }
+        names.resize(len);
+        for (size_t start= 0; start < names.length(); ) {
+            auto end= names.find('\0', start);
+            auto name= names.substr(start, end - start);
+            auto value_len= get_value(name.c_str(), nullptr, 0);
+            if (value_len >= 0) {
+                string value(value_len, '\0');
+                value_len= get_value(name.c_str(), value.data(), value.length());
+                if (value_len >= 0) {
+                    value.resize(value_len);
+                    xattrs.push_back(pair(name, value));
+                }
+            }
+            start= end + 1;
+        }
+        // listing order depends on the filesystem
+        xattrs.sort();
+        return xattrs;
+    }
+
+    list<pair<string, string>> read_fd_xattrs(int fd) {
+        return read_xattrs(
+            [fd](char * list, size_t size) { return flistxattr(fd, list, size); },
+            [fd](char const * name, void * value, size_t size) { return fgetxattr(fd, name, value, size); });
+    }
+
+    list<pair<string, string>> read_link_xattrs(int dirfd, char const * name) {
+        auto path= proc_path_at(dirfd, name);
+        return read_xattrs(
+            [&path](char * list, size_t size) { return llistxattr(path.c_str(), list, size); },
+            [&path](char const * name, void * value, size_t size) { return lgetxattr(path.c_str(), name, value, size); });
+    }
+#endif
+
+    struct entry_stat {
+        mode_t mode;
+        uint64_t size;
+        metadata meta;
+    };
+
+    // one statx per entry gives the type, the permission, the size and the
+    // metadata at once
+    optional<entry_stat> stat_at(int dirfd, char const * name) {
+        optional<entry_stat> empty;
+        entry_stat st;
+#if defined(STATX_BASIC_STATS)
+        struct statx stx;
+        auto mask= STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_UID | STATX_GID;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW, mask, &stx) != 0) {
+            return empty;
+        }
+        st.mode= stx.stx_mode;
+        st.size= stx.stx_size;
+        st.meta.mtime_sec= stx.stx_mtime.tv_sec;
+        st.meta.mtime_nsec= stx.stx_mtime.tv_nsec;
+        st.meta.uid= stx.stx_uid;
+        st.meta.gid= stx.stx_gid;
+#else
+        struct stat sb;
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            return empty;
+        }
+        st.mode= sb.st_mode;
+        st.size= sb.st_size;
+#if defined(__APPLE__)
+        st.meta.mtime_sec= sb.st_mtimespec.tv_sec;
+        st.meta.mtime_nsec= sb.st_mtimespec.tv_nsec;
+#else
+        st.meta.mtime_sec= sb.st_mtim.tv_sec;
+        st.meta.mtime_nsec= sb.st_mtim.tv_nsec;
+#endif
+        st.meta.uid= sb.st_uid;
+        st.meta.gid= sb.st_gid;
+#endif
+        return st;
+    }
+
+    string read_fd_content(int fd, uint64_t size_hint, fs::path const & path) {
+        // one byte of slack to notice a file grown since it was stat'ed; a
+        // read reaching the stat'ed size ends it without a second one waiting
+        // for the end of file, any other short read is not the end, a single
+        // read returns at most 2 GiB
+        string content(size_hint + 1, '\0');
+        uint64_t filled= 0;
+        do {
+            if (filled == content.length()) {
+                // the file grew since it was stat'ed
+                content.resize(max<uint64_t>(content.length() * 2, 4096));
+            }
+            auto got= ::read(fd, content.data() + filled, content.length() - filled);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw posix_error("read", path);
+            }
+            if (got == 0) {
+                break;
+            }
+            filled+= got;
+            if (filled == size_hint) {
+                break;
+            }
+        } while (true);
+        content.resize(filled);
+        return content;
+    }
+
+    string read_link_at(int dirfd, char const * name, uint64_t size_hint, fs::path const & path) {
+        string target(size_hint + 1, '\0');
+        do {
+            auto len= readlinkat(dirfd, name, target.data(), target.length());
+            if (len < 0) {
+                throw posix_error("readlink", path);
+            }
+            if (static_cast<uint64_t>(len) < target.length()) {
+                target.resize(len);
+                return target;
+            }
+            target.resize(target.length() * 2);
+        } while (true);
+    }
+
+    void read_file_at(int dirfd, char const * name, touch & touch, entry_stat const & st, fs::path const & root, read_options const & options) {
+        fd_guard file(openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        if (file.get() < 0) {
+            throw posix_error("open", root / name);
+        }
+        touch.content= read_fd_content(file.get(), st.size, root / name);
+#if defined(__linux__)
+        if (options.xattrs) {
+            touch.meta->xattrs= read_fd_xattrs(file.get());
+        }
+#endif
+    }
+
+    // a directory of the walk, which holds no fd: a tree may have more
+    // directories than a process may open, it is reopened from its parent
+    // when its files are read
+    struct walked_dir {
+        shared_ptr<walked_dir const> parent; // none for the root
+        string name;
+        fs::path path;
+    };
+
+    // opens the directories of a walk from its root, keeping the last ones
+    // used open, as the files of a directory are mostly read together
+    class dir_opener {
+    public:
+        static constexpr size_t kept= 8;
+
+        explicit dir_opener(fs::path const & root) : root_(open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+            if (root_.get() < 0) {
+                throw posix_error("open", root);
+            }
+        }
+
+        // the fd stays valid until the next call
+        int open_dir(shared_ptr<walked_dir const> const & dir) {
+            if (!dir->parent) {
+                return root_.get();
+            }
+            for (auto it= opened_.begin(); it != opened_.end(); ++it) {
+                if (it->dir == dir) {
+                    opened_.splice(opened_.begin(), opened_, it);
+                    return it->fd.get();
+                }
+            }
+            auto parent= open_dir(dir->parent);
+            auto fd= openat(parent, dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                throw posix_error("open", dir->path);
+            }
+            opened_.emplace_front(dir, fd);
+            if (opened_.size() > kept) {
+                opened_.pop_back();
+            }
+            return fd;
+        }
+
+    private:
+        struct opened_dir {
+            opened_dir(shared_ptr<walked_dir const> const & dir, int fd) : dir(dir), fd(fd) {}
+
+            shared_ptr<walked_dir const> dir;
+            fd_guard fd;
+        };
+
+        fd_guard root_;
+        std::list<opened_dir> opened_; // the most recently used first
+    };
+
+    // reads the contents of the files of a walk on workers kept for the
+    // whole walk: a tree of many small files is dominated by the per file
+    // syscalls, so the files are queued by batches, which cross directories,
+    // while large files go alone; the walker waits while too many batches
+    // are queued, and reads the files itself when there is a single worker
+    class content_reader {
+    public:
+        static constexpr uint64_t batch_bytes= 1 << 20;
+        static constexpr size_t batch_files= 256;
+
+        content_reader(fs::path const & root, read_options const & options)
+            : root_(root), options_(options), workers_(max<size_t>(options.threads ? options.threads : thread::hardware_concurrency(), 1)) {
+            if (workers_ > 1) {
+                try {
+                    for (size_t i= 0; i < workers_; i++) {
+                        threads_.emplace_back(&content_reader::run, this);
+                    }
+                } catch (...) {
+                    stop();
+                    throw;
+                }
+            }
+        }
+        content_reader(content_reader const &)= delete;
+        content_reader & operator=(content_reader const &)= delete;
+        ~content_reader() {
+            abort();
+        }
+
+        // target is filled once finish returns, rethrows the error of a
+        // failed read
+        void add(shared_ptr<walked_dir const> const & dir, int dirfd, string const & name, touch & target, entry_stat const & st) {
+            if (threads_.empty()) {
+                read_file_at(dirfd, name.c_str(), target, st, dir->path, options_);
+                return;
+            }
+            pending_.push_back({dir, name, &target, st});
+            pending_bytes_+= st.size;
+            if (pending_.size() >= batch_files || pending_bytes_ >= batch_bytes) {
+                flush();
+            }
+        }
+
+        // waits for the files added, rethrows the error of a failed read
+        void finish() {
+            flush();
+            stop();
+            if (error_) {
+                rethrow_exception(error_);
+            }
+        }
+
+        // stops the workers, the files queued are left unread
+        void abort() {
+            {
+                lock_guard<mutex> guard(lock_);
+                queued_.clear();
+            }
+            stop();
+        }
+
+    private:
+        struct file_entry {
+            shared_ptr<walked_dir const> dir;
+            string name;
+            touch * target;
+            entry_stat st;
+        };
+
+        void flush() {
+            if (pending_.empty()) {
+                return;
+            }
+            unique_lock<mutex> guard(lock_);
+            changed_.wait(guard, [this] { return queued_.size() < 2 * workers_ || error_; });
+            if (error_) {
+                rethrow_exception(error_);
+            }
+            queued_.push_back(move(pending_));
+            pending_.clear();
+            pending_bytes_= 0;
+            guard.unlock();
+            changed_.notify_all();
+        }
+
+        void stop() {
+            {
+                lock_guard<mutex> guard(lock_);
+                done_= true;
+            }
+            changed_.notify_all();
+            for (auto & worker: threads_) {
+                if (worker.joinable()) {
+                    worker.join();
+                }
+            }
+        }
+
+        void run() {
+            optional<dir_opener> dirs;
+            unique_lock<mutex> guard(lock_);
+            while (true) {
+                changed_.wait(guard, [this] { return !queued_.empty() || done_; });
+                if (queued_.empty()) {
+                    return;
+                }
+                auto batch= move(queued_.front());
+                queued_.pop_front();
+                auto failed= static_cast<bool>(error_);
+                guard.unlock();
+                changed_.notify_all();
+                try {
+                    if (!failed) {
+                        if (!dirs) {
+                            dirs.emplace(root_);
+                        }
+                        for (auto & file: batch) {
+                            read_file_at(dirs->open_dir(file.dir), file.name.c_str(), *file.target, file.st, file.dir->path, options_);
+                        }
+                    }
+                } catch (...) {
+                    guard.lock();
+                    if (!error_) {
+                        error_= current_exception();
+                    }
+                    guard.unlock();
+                    changed_.notify_all();
+                }
+                guard.lock();
+            }
+        }
+
+        fs::path root_;
+        read_options const & options_;
+        size_t workers_;
+        vector<file_entry> pending_;  // the batch being filled by the walker
+        uint64_t pending_bytes_= 0;
+        deque<vector<file_entry>> queued_;
+        bool done_= false;
+        exception_ptr error_;
+        mutex lock_;
+        condition_variable changed_;
+        vector<thread> threads_;
+    };
+
+    // takes the ownership of fd, the contents are left on disk if deferred
+    // is set, given to reader otherwise
+    tar read_fs_tree_at(int fd, shared_ptr<walked_dir const> const & walked, read_options const & options, deferred_contents * deferred, content_reader * reader) {
+        auto const & root= walked->path;
+        unique_ptr<DIR, int(*)(DIR*)> dir(fdopendir(fd), closedir);
+        if (!dir) {
+            auto error= posix_error("fdopendir", root);
+            close(fd);
+            throw error;
+        }
+        auto dfd= dirfd(dir.get());
+        auto want_meta= options.metadata || options.xattrs;
+
+        // a reproducible walk visits the entries in the order normalize sorts
+        // them to, so that the files are found in the order of the header
+        vector<string> names;
+        while (auto entry= readdir(dir.get())) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                names.emplace_back(entry->d_name);
+            }
+        }
+        if (options.reproducible) {
+            sort(names.begin(), names.end());
+        }
+
+        tar tar_current;
+        try {
+            for (auto const & entry_name: names) {
+                auto name= entry_name.c_str();
+                auto st= stat_at(dfd, name);
+                if (!st.has_value()) {
+                    // removed while walking
+                    continue;
+                }
+                optional<metadata> meta;
+                if (want_meta) {
+                    meta= st->meta;
+                }
+                if (S_ISLNK(st->mode)) {
+                    auto & link= get<slink>(tar_current.emplace_back(in_place_type<slink>));
+                    link.name= name;
+                    // the permission of symlink is irrelevant
+                    link.perm= perms_of_mode(st->mode);
+                    link.target= read_link_at(dfd, name, st->size, root / name);
+#if defined(__linux__)
+                    if (options.xattrs) {
+                        meta->xattrs= read_link_xattrs(dfd, name);
+                    }
+#endif
+                    link.meta= move(meta);
+                } else if (S_ISREG(st->mode)) {
+                    auto & touch= get<v1::touch>(tar_current.emplace_back(in_place_type<v1::touch>));
+                    touch.name= name;
+                    touch.perm= perms_of_mode(st->mode);
+                    touch.meta= move(meta);
+                    if (deferred != nullptr) {
+                        deferred->sizes[&touch]= st->size;
+#if defined(__linux__)
+                        if (options.xattrs) {
+                            fd_guard file(openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+                            if (file.get() < 0) {
+                                throw posix_error("open", root / name);
+                            }
+                            touch.meta->xattrs= read_fd_xattrs(file.get());
+                        }
+#endif
+                        if (deferred->found) {
+                            deferred->found(touch, walked, st->size);
+                        }
+                        continue;
+                    }
+                    reader->add(walked, dfd, entry_name, touch, st.value());
+                } else if (S_ISDIR(st->mode)) {
+                    auto child= openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    if (child < 0) {
+                        throw posix_error("open", root / name);
+                    }
+#if defined(__linux__)
+                    if (options.xattrs) {
+                        meta->xattrs= read_fd_xattrs(child);
+                    }
+#endif
+                    auto & dir= get<mkdir>(tar_current.emplace_back(in_place_type<mkdir>));
+                    dir.name= name;
+                    dir.perm= perms_of_mode(st->mode);
+                    auto child_walked= make_shared<walked_dir const>(walked_dir{walked, entry_name, root / name});
+                    dir.children= read_fs_tree_at(child, child_walked, options, deferred, reader);
+                    dir.meta= move(meta);
+                }
+            }
+        } catch (...) {
+            if (reader != nullptr) {
+                // the workers may still be filling the touches of tar_current
+                reader->abort();
+            }
+            throw;
+        }
+        return tar_current;
+    }
+
+    tar read_fs_tree_aux(fs::path const & root, read_options const & options, deferred_contents * deferred= nullptr) {
+        optional<content_reader> reader;
+        if (deferred == nullptr) {
+            reader.emplace(root, options);
+        }
+        auto fd= open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            throw posix_error("open", root);
+        }
+        auto walked= make_shared<walked_dir const>(walked_dir{nullptr, "", root});
+        auto tar= read_fs_tree_at(fd, walked, options, deferred, reader ? &*reader : nullptr);
+        if (reader) {
+            reader->finish();
+        }
+        return tar;
+    }
+#else
+    tar read_fs_tree_aux(fs::path const & root, read_options const & options) {
+        // no portable way to get the ownership and the timestamp, metadata
+        // is only collected on posix systems
         tar tar_current;
         for (auto const & entry: fs::directory_iterator(root)) {
             auto status= fs::status(entry);
@@ -411,7 +1330,7 @@ namespace minitar::v1 {
             } else if (fs::is_directory(entry)) {
                 mkdir dir;
                 tar tar_nested;
-                auto children= read_fs_tree_aux(entry.path());
+                auto children= read_fs_tree_aux(entry.path(), options);
                 dir.name= entry.path().filename();
                 dir.perm= status.permissions();
                 dir.children= children;
@@ -420,25 +1339,33 @@ namespace minitar::v1 {
         }
         return tar_current;
     }
+#endif
 
-    optional<tar> read_fs_tree(fs::path root) {
+    optional<tar> read_fs_tree(fs::path root, read_options const & options) {
         optional<tar> empty;
         if (fs::is_directory(root)) {
-            auto tar= read_fs_tree_aux(root);
+            auto tar= read_fs_tree_aux(root, options);
+            if (options.reproducible) {
+                normalize(tar);
+            }
             return tar;
         } else {
             return empty;
         }
     }
 
-    optional<mkdir> read_dir_tree(fs::path root) {
-        optional<mkdir> empty;
+    optional<tar> read_fs_tree(fs::path root) {
+        return read_fs_tree(root, read_options());
+    }
+
+    optional<mkdir> read_dir_tree(fs::path root) {
+        optional<mkdir> empty;
         if (fs::is_directory(root)) {
             mkdir dir;
             auto status= fs::status(root);
             dir.name= root;
             dir.perm= status.permissions();
-            auto tar= read_fs_tree_aux(root);
+            auto tar= read_fs_tree_aux(root, read_options());
             dir.children= tar;
             return dir;
         } else {
@@ -446,6 +1373,66 @@ namespace minitar::v1 {
         }
     }
 
+    string const & element_name(element const & element) {
+        return visit([](auto const & entry) -> string const & { return entry.name; }, element);
+    }
+
+    void collect_levels(tar & tar, vector<v1::tar*> & levels) {
+        levels.push_back(&tar);
+        for (auto & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                collect_levels(dir->children, levels);
+            }
+        }
+    }
+
+    void normalize_level(tar & tar, int64_t mtime) {
+        auto executable= fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec;
+        auto normalize_meta= [mtime](optional<metadata> & meta) {
+            if (meta.has_value()) {
+                meta->mtime_sec= mtime;
+                meta->mtime_nsec= 0;
+                meta->uid= 0;
+                meta->gid= 0;
+                meta->xattrs.sort();
+            }
+        };
+
+        tar.sort([](element const & a, element const & b) {
+            return element_name(a) < element_name(b);
+        });
+
+        for (auto & element: tar) {
+            visit(Overload {
+                [&normalize_meta](mkdir & mkdir) {
+                    mkdir.perm= static_cast<fs::perms>(0755);
+                    normalize_meta(mkdir.meta);
+                },
+                [&normalize_meta, executable](touch & touch) {
+                    auto is_exec= (touch.perm & executable) != fs::perms::none;
+                    touch.perm= static_cast<fs::perms>(is_exec ? 0755 : 0644);
+                    normalize_meta(touch.meta);
+                },
+                [&normalize_meta](slink & link) {
+                    link.perm= static_cast<fs::perms>(0777);
+                    normalize_meta(link.meta);
+                },
+            }, element);
+        }
+    }
+
+    void normalize(tar & tar, int64_t mtime) {
+        // every directory is sorted on its own, so the levels are spread
+        // over the cores instead of sorting the tree recursively
+        vector<v1::tar*> levels;
+        collect_levels(tar, levels);
+
+        size_t const per_worker= 64;
+        parallel_for(levels.size(), levels.size() / per_worker, [&levels, mtime](size_t i) {
+            normalize_level(*levels[i], mtime);
+        });
+    }
+
     void print_perm(fs::perms p) {
         auto show = [=](char op, fs::perms perm) {
             cout << (fs::perms::none == (perm & p) ? '-' : op);
@@ -512,75 +1499,361 @@ namespace minitar::v1 {
         }
     }
 
-    void write_fs_tree_aux(tar & tar, fs::path root, bool overwrite) {
+    // how existing entries are treated when extracting
+    // built from the answer to "overwrite?", the other fields are set by name
+    // a tree may come from an archive decoded without checks, an entry is
+    // never written outside of its directory
+    void check_name(fs::path const & root, string const & name) {
+        if (!valid_name(name.data(), name.length())) {
+            throw fs::filesystem_error("invalid name", root / fs::u8path(name), make_error_code(errc::invalid_argument));
+        }
+    }
+
+    struct write_policy {
+        using asker= function<bool(fs::path const & path, string const & content)>;
+
+        // the same answer for every entry, kept files get their permission
+        explicit write_policy(bool overwrite) : overwrite(overwrite), chmod_kept(true) {}
+        // the answer asked for each entry, kept files are left untouched
+        explicit write_policy(asker const & ask) : overwrite(false), ask(ask), chmod_kept(false) {}
+
+        bool overwrite;
+        asker ask;
+        bool chmod_kept; // apply the permission to kept files as well
+        bool defer_dirs= false; // leave the directory metadata to apply_dir_metadata
+        // takes over an opened file: writing its content, its metadata and
+        // closing fd, instead of writing touch.content (posix only)
+        function<void(int fd, touch const & touch, fs::path const & path)> write_content;
+        bool sync= false; // leave in place the files already holding their content
+        bool sync_by_mtime= false; // a same size and mtime tells a file unchanged
+
+        bool overwrite_entry(fs::path const & root, string const & name, string const & content) const {
+            if (ask) {
+                return ask(root / fs::u8path(name), content);
+            }
+            return overwrite;
+        }
+    };
+
+#if defined(MINITAR_POSIX)
+    timespec const * metadata_times(metadata const & meta, timespec (&times)[2]) {
+        times[0]= { 0, UTIME_OMIT };
+        times[1]= { static_cast<time_t>(meta.mtime_sec), static_cast<long>(meta.mtime_nsec) };
+        return times;
+    }
+
+    void apply_metadata(int fd, metadata const & meta, fs::perms perm) {
+        // only a privileged user is able to give files away, keep the
+        // current owner otherwise
+        [[maybe_unused]] auto owned= fchown(fd, meta.uid, meta.gid);
+        // chown clears set_uid and set_gid, so chmod after it
+        fchmod(fd, mode_of_perms(perm));
+#if defined(__linux__)
+        for (auto const & [name, value]: meta.xattrs) {
+            fsetxattr(fd, name.c_str(), value.data(), value.length(), 0);
+        }
+#endif
+        timespec times[2];
+        futimens(fd, metadata_times(meta, times));
+    }
+
+    void apply_link_metadata(int dirfd, char const * name, metadata const & meta) {
+        [[maybe_unused]] auto owned= fchownat(dirfd, name, meta.uid, meta.gid, AT_SYMLINK_NOFOLLOW);
+#if defined(__linux__)
+        auto path= proc_path_at(dirfd, name);
+        for (auto const & [xattr, value]: meta.xattrs) {
+            lsetxattr(path.c_str(), xattr.c_str(), value.data(), value.length(), 0);
+        }
+#endif
+        timespec times[2];
+        utimensat(dirfd, name, metadata_times(meta, times), AT_SYMLINK_NOFOLLOW);
+    }
+
+    // reads up to size bytes, less only at the end of the file
+    size_t read_fd_data(int fd, char * data, size_t size, fs::path const & path) {
+        size_t filled= 0;
+        while (filled < size) {
+            auto got= ::read(fd, data + filled, size - filled);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw posix_error("read", path);
+            }
+            if (got == 0) {
+                break;
+            }
+            filled+= got;
+        }
+        return filled;
+    }
+
+    void write_fd_data(int fd, char const * data, size_t remain, fs::path const & path) {
+        while (remain > 0) {
+            auto written= ::write(fd, data, remain);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw posix_error("write", path);
+            }
+            data+= written;
+            remain-= written;
+        }
+    }
+
+    void write_fd_content(int fd, string const & content, fs::path const & path) {
+        write_fd_data(fd, content.data(), content.length(), path);
+    }
+
+    // the file is still open, so its metadata is applied without another lookup
+    void apply_file_metadata(int fd, touch const & touch) {
+        if (touch.meta.has_value()) {
+            apply_metadata(fd, touch.meta.value(), touch.perm);
+        } else {
+            fchmod(fd, mode_of_perms(touch.perm));
+        }
+    }
+
+    // the contents are compared by slices, so that a file differing early is
+    // barely read
+    size_t const compare_slice= 1 << 20;
+
+    // a regular file of the size of the content, with the same mtime when the
+    // archive mtimes tell the contents apart, or else with the same bytes in
+    // every slice; only its metadata is applied then
+    bool unchanged_at(int dirfd, fs::path const & root, touch const & touch, bool by_mtime) {
+        auto name= touch.name.c_str();
+        auto const & content= touch.content;
+        auto st= stat_at(dirfd, name);
+        if (!st.has_value() || !S_ISREG(st->mode) || st->size != content.length()) {
+            return false;
+        }
+        fd_guard fd(openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC));
+        if (fd.get() < 0) {
+            return false;
+        }
+        auto const & meta= touch.meta;
+        auto same_mtime= by_mtime && meta.has_value() && meta->mtime_sec == st->meta.mtime_sec && meta->mtime_nsec == st->meta.mtime_nsec;
+        if (!same_mtime) {
+            vector<char> slice(min(compare_slice, content.length()));
+            for (size_t at= 0; at < content.length(); at+= slice.size()) {
+                auto size= min(slice.size(), content.length() - at);
+                if (read_fd_data(fd.get(), slice.data(), size, root / fs::u8path(touch.name)) != size
+                        || memcmp(slice.data(), content.data() + at, size) != 0) {
+                    return false;
+                }
+            }
+        }
+        apply_file_metadata(fd.get(), touch);
+        return true;
+    }
+
+    void write_file_at(int dirfd, fs::path const & root, touch const & touch, write_policy const & policy) {
+        auto name= touch.name.c_str();
+        auto flags= O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+        fd_guard fd(openat(dirfd, name, flags, 0600));
+        if (fd.get() < 0 && errno == ELOOP) {
+            // never write through a symlink planted at the place of the file
+            unlinkat(dirfd, name, 0);
+            fd.fd= openat(dirfd, name, flags, 0600);
+        }
+        if (fd.get() < 0) {
+            throw posix_error("open", root / fs::u8path(touch.name));
+        }
+        if (policy.write_content) {
+            policy.write_content(fd.release(), touch, root / fs::u8path(touch.name));
+            return;
+        }
+        write_fd_content(fd.get(), touch.content, root / fs::u8path(touch.name));
+        apply_file_metadata(fd.get(), touch);
+    }
+
+    // entries are resolved relative to the opened directory, so long paths
+    // are not walked again for every entry, and a directory swapped for a
+    // symlink while extracting is never followed; as every name is a single
+    // component, nothing is written outside of root
+    void write_fs_tree_at(int dirfd, fs::path const & root, tar const & tar, write_policy const & policy) {
         auto elementWriter = Overload {
-            [&root, &overwrite](mkdir & mkdir) {
-                auto path= root / mkdir.name;
-                mkdir_p(path);
-                fs::permissions(path, mkdir.perm);
-                write_fs_tree_aux(mkdir.children, path, overwrite);
+            [dirfd, &root, &policy](mkdir const & mkdir) {
+                check_name(root, mkdir.name);
+                auto name= mkdir.name.c_str();
+                if (mkdirat(dirfd, name, 0700) != 0 && errno != EEXIST) {
+                    throw posix_error("mkdir", root / fs::u8path(mkdir.name));
+                }
+                fd_guard fd(openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+                if (fd.get() < 0) {
+                    throw posix_error("open", root / fs::u8path(mkdir.name));
+                }
+                write_fs_tree_at(fd.get(), root / fs::u8path(mkdir.name), mkdir.children, policy);
+                // applied after the children, writing into a directory bumps
+                // its mtime and a read-only permission would forbid the writes
+                if (policy.defer_dirs) {
+                    return;
+                }
+                if (mkdir.meta.has_value()) {
+                    apply_metadata(fd.get(), mkdir.meta.value(), mkdir.perm);
+                } else {
+                    fchmod(fd.get(), mode_of_perms(mkdir.perm));
+                }
             },
-            [&root, &overwrite](touch & touch) {
-                auto path= root / fs::u8path(touch.name);
-                if(overwrite || !fs::exists(path)) {
-                    ofstream ofs;
-                    ofs.open(path);
-                    ofs << touch.content;
-                    ofs.close();
+            [dirfd, &root, &policy](touch const & touch) {
+                check_name(root, touch.name);
+                if (policy.sync && unchanged_at(dirfd, root, touch, policy.sync_by_mtime)) {
+                    return;
+                }
+                auto name= touch.name.c_str();
+                struct stat st;
+                auto overwrite= policy.overwrite_entry(root, touch.name, touch.content);
+                if (overwrite || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    write_file_at(dirfd, root, touch, policy);
+                } else if (policy.chmod_kept && S_ISREG(st.st_mode)) {
+                    // through the opened file, fchmodat would follow a
+                    // symlink swapped in since the fstatat
+                    fd_guard fd(openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC));
+                    struct stat opened;
+                    if (fd.get() >= 0 && fstat(fd.get(), &opened) == 0 && S_ISREG(opened.st_mode)) {
+                        fchmod(fd.get(), mode_of_perms(touch.perm));
+                    }
                 }
-                fs::permissions(path, touch.perm);
             },
-            [&root, &overwrite](slink & link) {
-                auto link_file= root / fs::u8path(link.name);
-                auto to= fs::u8path(link.target);
-                if(overwrite && fs::exists(link_file)) {
-                    fs::remove(link_file);
+            [dirfd, &root, &policy](slink const & link) {
+                check_name(root, link.name);
+                auto name= link.name.c_str();
+                struct stat st;
+                auto exists= fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+                if (policy.sync && exists && S_ISLNK(st.st_mode)) {
+                    // a link already pointing to the target is kept, recreating
+                    // it would write to its directory
+                    string target(link.target.length() + 1, '\0');
+                    auto len= readlinkat(dirfd, name, target.data(), target.length());
+                    if (len >= 0 && static_cast<size_t>(len) == link.target.length() && target.compare(0, len, link.target) == 0) {
+                        if (link.meta.has_value()) {
+                            apply_link_metadata(dirfd, name, link.meta.value());
+                        }
+                        return;
+                    }
                 }
-                if (!fs::exists(link_file)) {
-                    filesystem::create_symlink(to, link_file);
+                if (policy.overwrite_entry(root, link.name, link.target) && exists) {
+                    auto flags= S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0;
+                    if (unlinkat(dirfd, name, flags) != 0) {
+                        throw posix_error("unlink", root / fs::u8path(link.name));
+                    }
+                    exists= false;
+                }
+                if (!exists) {
+                    if (symlinkat(link.target.c_str(), dirfd, name) != 0) {
+                        throw posix_error("symlink", root / fs::u8path(link.name));
+                    }
+                    if (link.meta.has_value()) {
+                        apply_link_metadata(dirfd, name, link.meta.value());
+                    }
                 }
-                // fs::permissions(link_file, link.perm);
                 // the permission of symlink is irrelevant
             },
         };
 
-        for (auto & element: tar) {
+        for (auto const & element: tar) {
             visit(elementWriter, element);
         }
     }
 
-    void write_fs_tree(tar & tar, fs::path root, bool overwrite) {
+    void write_fs_tree_aux(tar const & tar, fs::path root, write_policy const & policy) {
         mkdir_p(root);
-        write_fs_tree_aux(tar, root, overwrite);
+        auto path= root.empty() ? fs::path(".") : root;
+        fd_guard fd(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            throw posix_error("open", root);
+        }
+        write_fs_tree_at(fd.get(), root, tar, policy);
     }
 
-    void write_dir_tree(mkdir & dir, fs::path root, bool overwrite) {
-        mkdir_p(root/dir.name);
-        write_fs_tree_aux(dir.children, root/dir.name, overwrite);
+    void apply_dir_metadata_at(int dirfd, fs::path const & root, tar const & tar) {
+        for (auto const & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                auto fd= fd_guard(openat(dirfd, dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+                if (fd.get() < 0) {
+                    throw posix_error("open", root / fs::u8path(dir->name));
+                }
+                apply_dir_metadata_at(fd.get(), root / fs::u8path(dir->name), dir->children);
+                if (dir->meta.has_value()) {
+                    apply_metadata(fd.get(), dir->meta.value(), dir->perm);
+                } else {
+                    fchmod(fd.get(), mode_of_perms(dir->perm));
+                }
+            }
+        }
+    }
+
+    // the second half of an extraction with defer_dirs set
+    void apply_dir_metadata(tar const & tar, fs::path root) {
+        auto path= root.empty() ? fs::path(".") : root;
+        fd_guard fd(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            throw posix_error("open", root);
+        }
+        apply_dir_metadata_at(fd.get(), root, tar);
+    }
+#else
+    // without metadata, the contents are compared by slices
+    bool unchanged_path(fs::path const & path, touch const & touch) {
+        auto const & content= touch.content;
+        error_code error;
+        if (!fs::is_regular_file(fs::symlink_status(path, error)) || fs::file_size(path, error) != content.length()) {
+            return false;
+        }
+        ifstream ifs(path, ios::binary);
+        vector<char> slice(min<size_t>(1 << 20, content.length()));
+        for (size_t at= 0; at < content.length(); at+= slice.size()) {
+            auto size= min(slice.size(), content.length() - at);
+            ifs.read(slice.data(), size);
+            if (static_cast<size_t>(ifs.gcount()) != size
+                    || memcmp(slice.data(), content.data() + at, size) != 0) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    void write_fs_tree_aux(tar & tar, fs::path root, function<bool(fs::path const & path, string const & content)> const & overwrite) {
+    // no portable way to set the ownership and the timestamp, metadata is
+    // only applied on posix systems
+    void write_fs_tree_path(tar const & tar, fs::path root, write_policy const & policy) {
         auto elementWriter = Overload {
-            [&root, overwrite](mkdir & mkdir) {
+            [&root, &policy](mkdir const & mkdir) {
+                check_name(root, mkdir.name);
                 auto path= root / mkdir.name;
                 mkdir_p(path);
-                fs::permissions(path, mkdir.perm);
-                write_fs_tree_aux(mkdir.children, path, overwrite);
+                if (!policy.defer_dirs) {
+                    fs::permissions(path, mkdir.perm);
+                }
+                write_fs_tree_path(mkdir.children, path, policy);
             },
-            [&root, overwrite](touch & touch) {
+            [&root, &policy](touch const & touch) {
+                check_name(root, touch.name);
                 auto path= root / fs::u8path(touch.name);
-                if(overwrite(path, touch.content) || !fs::exists(path)) {
+                if (policy.sync && unchanged_path(path, touch)) {
+                    fs::permissions(path, touch.perm);
+                    return;
+                }
+                if(policy.overwrite_entry(root, touch.name, touch.content) || !fs::exists(path)) {
                     ofstream ofs;
                     ofs.open(path);
                     ofs << touch.content;
                     ofs.close();
                     fs::permissions(path, touch.perm);
+                } else if (policy.chmod_kept && fs::is_regular_file(fs::symlink_status(path))) {
+                    fs::permissions(path, touch.perm);
                 }
             },
-            [&root, overwrite](slink & link) {
+            [&root, &policy](slink const & link) {
+                check_name(root, link.name);
                 auto link_file= root / fs::u8path(link.name);
                 auto to= fs::u8path(link.target);
-                if(overwrite(link_file, link.target) && fs::exists(link_file)) {
+                error_code error;
+                if (policy.sync && fs::is_symlink(fs::symlink_status(link_file, error)) && fs::read_symlink(link_file, error) == to) {
+                    return;
+                }
+                if(policy.overwrite_entry(root, link.name, link.target) && fs::exists(link_file)) {
                     fs::remove(link_file);
                 }
                 if (!fs::exists(link_file)) {
@@ -591,36 +1864,95 @@ namespace minitar::v1 {
             },
         };
 
-        for (auto & element: tar) {
+        for (auto const & element: tar) {
             visit(elementWriter, element);
         }
     }
 
-    void write_fs_tree(tar & tar, fs::path root, function<bool(fs::path const & path, string const & content)> const & overwrite) {
+    void write_fs_tree_aux(tar const & tar, fs::path root, write_policy const & policy) {
         mkdir_p(root);
-        write_fs_tree_aux(tar, root, overwrite);
+        write_fs_tree_path(tar, root, policy);
+    }
+
+    void apply_dir_metadata(tar const & tar, fs::path root) {
+        for (auto const & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                apply_dir_metadata(dir->children, root / dir->name);
+                fs::permissions(root / dir->name, dir->perm);
+            }
+        }
+    }
+#endif
+
+    void write_fs_tree(tar & tar, fs::path root, bool overwrite) {
+        write_fs_tree_aux(tar, root, write_policy(overwrite));
+    }
+
+    void write_dir_tree(mkdir & dir, fs::path root, bool overwrite) {
+        write_fs_tree_aux(dir.children, root/dir.name, write_policy(overwrite));
+    }
+
+    void write_fs_tree(tar & tar, fs::path root, function<bool(fs::path const & path, string const & content)> const & overwrite) {
+        write_fs_tree_aux(tar, root, write_policy(overwrite));
+    }
+
+    // true once two entries have different mtimes, first is the first
+    // metadata met
+    bool mtimes_vary(tar const & tar, metadata const * & first) {
+        for (auto const & element: tar) {
+            auto const & meta= visit([](auto const & entry) -> optional<metadata> const & { return entry.meta; }, element);
+            if (meta.has_value()) {
+                if (first == nullptr) {
+                    first= &meta.value();
+                } else if (first->mtime_sec != meta->mtime_sec || first->mtime_nsec != meta->mtime_nsec) {
+                    return true;
+                }
+            }
+            auto dir= get_if<mkdir>(&element);
+            if (dir != nullptr && mtimes_vary(dir->children, first)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void sync_fs_tree(tar const & tar, fs::path root) {
+        write_policy policy(true);
+        policy.sync= true;
+        // a normalized archive gives every entry the same mtime, which then
+        // tells nothing of the content
+        metadata const * first= nullptr;
+        policy.sync_by_mtime= mtimes_vary(tar, first);
+        write_fs_tree_aux(tar, root, policy);
     }
 
-    size_t marshal_size_aux(tar const & tar, size_t acc) {
+    size_t marshal_size_aux(tar const & tar, size_t acc, uint8_t version) {
+        auto meta_size= [version](optional<metadata> const & meta) -> size_t {
+            return version >= version_metadata ? metadata_size(meta) : 0;
+        };
+
         auto elementWriter = Overload {
-            [&acc](mkdir const & mkdir) {
+            [&acc, &meta_size, version](mkdir const & mkdir) {
                 acc+= sizeof(strlen_t);
                 acc+= mkdir.name.length();
                 acc+= sizeof(uint16_t);
-                acc+= marshal_size_aux(mkdir.children, acc);
+                acc+= meta_size(mkdir.meta);
+                acc= marshal_size_aux(mkdir.children, acc, version);
                 acc+= 1; // CDUP
             },
-            [&acc](touch const & touch) {
+            [&acc, &meta_size](touch const & touch) {
                 acc+= sizeof(strlen_t);
                 acc+= touch.name.length();
                 acc+= sizeof(uint16_t);
+                acc+= meta_size(touch.meta);
                 acc+= sizeof(size_t);
                 acc+= touch.content.length();
             },
-            [&acc](slink const & link) {
+            [&acc, &meta_size](slink const & link) {
                 acc+= sizeof(strlen_t);
                 acc+= link.name.length();
                 acc+= sizeof(uint16_t);
+                acc+= meta_size(link.meta);
                 acc+= sizeof(strlen_t);
                 acc+= link.target.length();
             },
@@ -635,36 +1967,51 @@ namespace minitar::v1 {
     }
 
     size_t marshal_size(tar const & tar) {
-        return marshal_size_aux(tar, magic.length() + sizeof(uint8_t))
+        auto version= has_metadata(tar) ? version_metadata : version_plain;
+        return marshal_size_aux(tar, magic.length() + sizeof(uint8_t), version)
             + 1; // EXIT
     }
 
-    void* write_tar_aux(tar const & tar, touche_contents & contents, void* data) {
+    void* write_tar_aux(tar const & tar, touche_contents & contents, void* data, uint8_t version, content_sizes const * sizes) {
         auto ptr= data;
+        auto with_meta= version >= version_metadata;
+
+        auto write_name= [&ptr](v1::action action, string const & name) {
+            ptr= fields<uint8_t, strlen_t>::store(ptr, static_cast<uint8_t>(action), name.length());
+            ptr= write_string(name, ptr);
+        };
 
         auto elementWriter = Overload {
-            [&ptr, &contents](mkdir const & mkdir) {
-                ptr= write_action(action::MKDIR, ptr);
-                ptr= write_uint32(mkdir.name.length(), ptr);
-                ptr= write_string(mkdir.name, ptr);
-                ptr= write_perms(mkdir.perm, ptr);
-                ptr= write_tar_aux(mkdir.children, contents, ptr);
+            [&ptr, &contents, &write_name, with_meta, version, sizes](mkdir const & mkdir) {
+                write_name(action::MKDIR, mkdir.name);
+                ptr= perm_fields::store(ptr, uint16_of_perms(mkdir.perm));
+                if (with_meta) {
+                    ptr= write_metadata(mkdir.meta, ptr);
+                }
+                ptr= write_tar_aux(mkdir.children, contents, ptr, version, sizes);
                 ptr= write_action(action::CDUP, ptr);
             },
-            [&ptr, &contents](touch const & touch) {
-                ptr= write_action(action::TOUCH, ptr);
-                ptr= write_uint32(touch.name.length(), ptr);
-                ptr= write_string(touch.name, ptr);
-                ptr= write_perms(touch.perm, ptr);
-                ptr= write_uint64(touch.content.length(), ptr);
-                contents.push_back(touch.content);
+            [&ptr, &contents, &write_name, with_meta, sizes](touch const & touch) {
+                write_name(action::TOUCH, touch.name);
+                auto size= sizes != nullptr ? sizes->at(&touch) : touch.content.length();
+                if (with_meta) {
+                    ptr= perm_fields::store(ptr, uint16_of_perms(touch.perm));
+                    ptr= write_metadata(touch.meta, ptr);
+                    ptr= write_uint64(size, ptr);
+                } else {
+                    ptr= touch_fields::store(ptr, uint16_of_perms(touch.perm), size);
+                }
+                contents.push_back(&touch.content);
             },
-            [&ptr](slink const & link) {
-                ptr= write_action(action::SLINK, ptr);
-                ptr= write_uint32(link.name.length(), ptr);
-                ptr= write_string(link.name, ptr);
-                ptr= write_perms(link.perm, ptr);
-                ptr= write_uint32(link.target.length(), ptr);
+            [&ptr, &write_name, with_meta](slink const & link) {
+                write_name(action::SLINK, link.name);
+                if (with_meta) {
+                    ptr= perm_fields::store(ptr, uint16_of_perms(link.perm));
+                    ptr= write_metadata(link.meta, ptr);
+                    ptr= write_uint32(link.target.length(), ptr);
+                } else {
+                    ptr= slink_fields::store(ptr, uint16_of_perms(link.perm), link.target.length());
+                }
                 ptr= write_string(link.target, ptr);
             },
         };
@@ -676,18 +2023,84 @@ namespace minitar::v1 {
         return ptr;
     }
 
-    void marshal(tar const & tar, void* data) {
+    // the sizes of the contents are taken from sizes when it is set
+    void* write_header(tar const & tar, touche_contents & contents, void* data, content_sizes const * sizes= nullptr) {
         auto ptr= data;
-        touche_contents contents;
+        auto version= has_metadata(tar) ? version_metadata : version_plain;
         ptr= write_string(magic, ptr);
-        ptr= write_uint8(1, ptr);
-        ptr= write_tar_aux(tar, contents, ptr);
+        ptr= write_uint8(version, ptr);
+        ptr= write_tar_aux(tar, contents, ptr, version, sizes);
         ptr= write_action(action::EXIT, ptr);
-        for (auto const & content : contents) {
-            ptr= write_string(content, ptr);
+        return ptr;
+    }
+
+    void marshal(tar const & tar, void* data) {
+        touche_contents contents;
+        auto ptr= write_header(tar, contents, data);
+        for (auto content : contents) {
+            ptr= write_string(*content, ptr);
         }
     }
 
+    size_t contents_size(tar const & tar) {
+        size_t acc= 0;
+        for (auto const & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                acc+= contents_size(dir->children);
+            } else if (auto file= get_if<touch>(&element)) {
+                acc+= file->content.length();
+            }
+        }
+        return acc;
+    }
+
+    marshaled marshal_iov(tar const & tar) {
+        // the header is the only part encoded, the contents are referenced
+        // where they are
+        marshaled result;
+        touche_contents contents;
+        result.header.resize(marshal_size(tar) - contents_size(tar));
+        write_header(tar, contents, result.header.data());
+        result.pieces.reserve(contents.size() + 1);
+        result.pieces.push_back({result.header.data(), result.header.size()});
+        for (auto content : contents) {
+            if (!content->empty()) {
+                result.pieces.push_back({const_cast<char*>(content->data()), content->length()});
+            }
+        }
+        return result;
+    }
+
+#if defined(MINITAR_POSIX)
+    void writev_all(int fd, vector<iovec> const & pieces) {
+        // writev takes at most IOV_MAX pieces and may write partially
+        vector<iovec> batch;
+        auto next= pieces.begin();
+        while (next != pieces.end() || !batch.empty()) {
+            while (batch.size() < IOV_MAX && next != pieces.end()) {
+                batch.push_back(*next++);
+            }
+            auto written= ::writev(fd, batch.data(), batch.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw fs::filesystem_error("writev", error_code(errno, generic_category()));
+            }
+            auto done= batch.begin();
+            while (done != batch.end() && static_cast<size_t>(written) >= done->iov_len) {
+                written-= done->iov_len;
+                done++;
+            }
+            batch.erase(batch.begin(), done);
+            if (!batch.empty()) {
+                batch.front().iov_base= static_cast<char*>(batch.front().iov_base) + written;
+                batch.front().iov_len-= written;
+            }
+        }
+    }
+#endif
+
     template<typename stream>
     void stream_write_tar_aux(tar const & tar, touche_contents & contents, StreamWriter<stream> & writer) {
         auto elementWriter = Overload {
@@ -705,7 +2118,7 @@ namespace minitar::v1 {
                 writer.write_string(touch.name);
                 writer.write_uint16(uint16_of_perms(touch.perm));
                 writer.write_uint64(touch.content.length());
-                contents.push_back(touch.content);
+                contents.push_back(&touch.content);
             },
             [&writer](slink const & link) {
                 writer.write_uint8(action::SLINK);
@@ -729,10 +2142,1229 @@ namespace minitar::v1 {
         writer.write_uint8(1);
         stream_write_tar_aux<stream>(tar, contents, writer);
         writer.write_uint8(action::EXIT);
-        for (auto const & content : contents) {
-            writer.write_string(content);
+        for (auto content : contents) {
+            writer.write_string(*content);
         }
     }
 
-}
+    string const manifest_magic= "MINITARS";
+    uint8_t const manifest_version= 1;
+
+    // moves the entries of a tree into the current segment, starting a new
+    // one, with copies of the ancestor directories, when it is full
+    struct splitter {
+        uint64_t segment_size;
+        uint64_t used;
+        vector<tar> segments;
+        vector<mkdir const *> ancestors;
+        vector<tar*> cursor;
+
+        void start_segment() {
+            segments.emplace_back();
+            used= 0;
+            cursor.assign(1, &segments.back());
+            for (auto ancestor: ancestors) {
+                auto & copy= cursor.back()->emplace_back(mkdir{ancestor->name, ancestor->perm, {}, ancestor->meta});
+                cursor.push_back(&get<mkdir>(copy).children);
+            }
+        }
+
+        void add(element && element, uint64_t cost) {
+            if (used > 0 && used + cost > segment_size) {
+                start_segment();
+            }
+            used+= cost;
+            cursor.back()->push_back(move(element));
+        }
+
+        void split(tar & level) {
+            for (auto & element: level) {
+                if (auto dir= get_if<mkdir>(&element)) {
+                    auto & copy= cursor.back()->emplace_back(mkdir{dir->name, dir->perm, {}, dir->meta});
+                    used+= dir->name.length();
+                    ancestors.push_back(dir);
+                    cursor.push_back(&get<mkdir>(copy).children);
+                    split(dir->children);
+                    cursor.pop_back();
+                    ancestors.pop_back();
+                } else {
+                    auto cost= visit(Overload {
+                        [](mkdir const &) -> uint64_t { return 0; },
+                        [](touch const & touch) -> uint64_t { return touch.name.length() + touch.content.length(); },
+                        [](slink const & link) -> uint64_t { return link.name.length() + link.target.length(); },
+                    }, element);
+                    add(move(element), cost);
+                }
+            }
+        }
+    };
+
+    vector<tar> split(tar tar, size_t segment_size) {
+        splitter splitter{max<uint64_t>(segment_size, 1), 0, {}, {}, {}};
+        splitter.start_segment();
+        splitter.split(tar);
+        return move(splitter.segments);
+    }
+
+    vector<string> marshal_segments(tar tar, size_t segment_size) {
+        auto segments= split(move(tar), segment_size);
+        vector<string> blobs(segments.size());
+        parallel_for(segments.size(), segments.size(), [&segments, &blobs](size_t i) {
+            blobs[i].resize(marshal_size(segments[i]));
+            marshal(segments[i], blobs[i].data());
+            segments[i].clear();
+        });
+        return blobs;
+    }
+
+    string marshal_manifest(vector<string> const & segments) {
+        string manifest(manifest_magic.length() + sizeof(uint8_t) + sizeof(uint32_t)
+            + segments.size() * sizeof(uint64_t), '\0');
+        void* ptr= manifest.data();
+        ptr= write_string(manifest_magic, ptr);
+        ptr= write_uint8(manifest_version, ptr);
+        ptr= write_uint32(segments.size(), ptr);
+        for (auto const & segment: segments) {
+            ptr= write_uint64(segment.length(), ptr);
+        }
+        return manifest;
+    }
+
+    optional<pair<vector<size_t>, void const *>> unmarshal_manifest(void const * data) {
+        optional<pair<vector<size_t>, void const *>> empty;
+        auto ptr= data;
+
+        string header_magic;
+        tie(header_magic, ptr)= read_string(ptr, manifest_magic.length());
+        if (header_magic != manifest_magic) {
+            return empty;
+        }
+
+        uint8_t version;
+        tie(version, ptr)= read_uint8(ptr);
+        if (version != manifest_version) {
+            return empty;
+        }
+
+        uint32_t count;
+        tie(count, ptr)= read_uint32(ptr);
+        vector<size_t> sizes(count);
+        for (auto & size: sizes) {
+            tie(size, ptr)= read_uint64(ptr);
+        }
+        return pair(sizes, ptr);
+    }
+
+    // keeps the skeleton of a written tree for apply_dir_metadata
+    void drop_contents(tar & tar) {
+        for (auto & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                drop_contents(dir->children);
+            } else if (auto file= get_if<touch>(&element)) {
+                string().swap(file->content);
+            }
+        }
+    }
+
+    void write_segments(vector<void const *> const & segments, fs::path root, bool overwrite) {
+        // segments overlap on their ancestor directories, so the directory
+        // permissions and metadata are applied once every segment is written
+        vector<tar> tars(segments.size());
+        write_policy policy(overwrite);
+        policy.defer_dirs= true;
+        mkdir_p(root);
+        parallel_for(segments.size(), segments.size(), [&segments, &tars, &root, &policy](size_t i) {
+            auto decoded= unmarshal(segments[i]);
+            if (!decoded.has_value()) {
+                throw runtime_error("minitar: segment " + to_string(i) + " is not an archive");
+            }
+            tars[i]= move(decoded->first);
+            write_fs_tree_aux(tars[i], root, policy);
+            drop_contents(tars[i]);
+        });
+        for (auto const & tar: tars) {
+            apply_dir_metadata(tar, root);
+        }
+    }
+
+    string const journal_magic= "MINITARJ";
+
+    // entries of from override the entries of the same name in into,
+    // directories are merged
+    void merge(tar & into, tar && from) {
+        unordered_map<string, tar::iterator> index;
+        for (auto it= into.begin(); it != into.end(); it++) {
+            index[element_name(*it)]= it;
+        }
+        for (auto & element: from) {
+            auto found= index.find(element_name(element));
+            if (found == index.end()) {
+                auto it= into.insert(into.end(), move(element));
+                index[element_name(*it)]= it;
+                continue;
+            }
+            auto old_dir= get_if<mkdir>(&*found->second);
+            auto new_dir= get_if<mkdir>(&element);
+            if (old_dir && new_dir) {
+                old_dir->perm= new_dir->perm;
+                old_dir->meta= move(new_dir->meta);
+                merge(old_dir->children, move(new_dir->children));
+            } else {
+                *found->second= move(element);
+            }
+        }
+    }
+
+    // every segment is followed by a trailer: uint64 size of the segment,
+    // magic. append only adds a record at the end of the file, the records
+    // already written are never overwritten
+    size_t const journal_trailer_size= sizeof(uint64_t) + journal_magic.length();
+
+    // the size of the complete records at the start of data, each segment
+    // checked with scan_header; a record cut short by a crash while it was
+    // appended ends the journal
+    pair<vector<pair<char const *, size_t>>, size_t> journal_records(void const * data, size_t size) {
+        vector<pair<char const *, size_t>> segments;
+        auto base= static_cast<char const *>(data);
+        size_t at= 0;
+        while (size - at > journal_trailer_size) {
+            auto skeleton= scan_header(base + at, size - at - journal_trailer_size);
+            if (!skeleton.has_value()) {
+                break;
+            }
+            auto segment_size= skeleton->contents + skeleton->contents_size;
+            auto trailer= base + at + segment_size;
+            if (load_le<uint64_t>(trailer) != segment_size
+                    || memcmp(trailer + sizeof(uint64_t), journal_magic.data(), journal_magic.length()) != 0) {
+                break;
+            }
+            segments.emplace_back(base + at, segment_size);
+            at+= segment_size + journal_trailer_size;
+        }
+        return pair(move(segments), at);
+    }
+
+    string marshal_journal_trailer(size_t segment_size) {
+        string trailer(journal_trailer_size, '\0');
+        auto ptr= write_uint64(segment_size, trailer.data());
+        write_string(journal_magic, ptr);
+        return trailer;
+    }
+
+    optional<tar> unmarshal_journal(void const * data, size_t size) {
+        optional<tar> empty;
+        auto segments= journal_records(data, size).first;
+        if (segments.empty()) {
+            return empty;
+        }
+
+        // segments decode independently, only the merge is sequential
+        vector<optional<pair<tar, void const *>>> decoded(segments.size());
+        parallel_for(segments.size(), segments.size(), [&segments, &decoded](size_t i) {
+            decoded[i]= unmarshal(segments[i].first);
+        });
+        tar tar;
+        for (auto & segment: decoded) {
+            if (!segment.has_value()) {
+                return empty;
+            }
+            merge(tar, move(segment->first));
+        }
+        return tar;
+    }
+
+    // flushed to the disk, so that a record is complete before the next
+    // write depends on it
+    void sync_file(fs::path const & path) {
+#if defined(MINITAR_POSIX)
+        fd_guard fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0 || fsync(fd.get()) != 0) {
+            throw posix_error("fsync", path);
+        }
+#endif
+    }
 
+    void write_file(fs::path const & path, uint64_t offset, string const & data) {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        file.seekp(offset);
+        file.write(data.data(), data.length());
+        file.close();
+        if (!file) {
+            throw fs::filesystem_error("write", path, make_error_code(errc::io_error));
+        }
+        sync_file(path);
+    }
+
+    // the last record is complete if the trailer ends the file and tells the
+    // start of a segment
+    bool journal_tail_complete(fs::path const & archive, uint64_t file_size) {
+        if (file_size < journal_trailer_size) {
+            return false;
+        }
+        ifstream file(archive, ios::binary);
+        string trailer(journal_trailer_size, '\0');
+        file.seekg(file_size - trailer.length());
+        file.read(trailer.data(), trailer.length());
+        auto segment_size= load_le<uint64_t>(trailer.data());
+        if (!file || trailer.substr(sizeof(uint64_t)) != journal_magic
+                || segment_size > file_size - trailer.length() || segment_size <= magic.length()) {
+            return false;
+        }
+        string start(magic.length() + 1, '\0');
+        file.seekg(file_size - trailer.length() - segment_size);
+        file.read(start.data(), start.length());
+        auto version= static_cast<uint8_t>(start.back());
+        return file && start.compare(0, magic.length(), magic) == 0
+            && (version == version_plain || version == version_metadata);
+    }
+
+    void append(fs::path archive, tar const & tar) {
+        string segment(marshal_size(tar), '\0');
+        marshal(tar, segment.data());
+        auto trailer= marshal_journal_trailer(segment.length());
+
+        if (!fs::exists(archive)) {
+            // created under another name and renamed once complete
+            auto created= archive;
+            created+= ".tmp";
+            ofstream file(created, ios::binary | ios::trunc);
+            file.write(segment.data(), segment.length());
+            file.write(trailer.data(), trailer.length());
+            file.close();
+            if (!file) {
+                throw fs::filesystem_error("write", created, make_error_code(errc::io_error));
+            }
+            sync_file(created);
+            fs::rename(created, archive);
+            return;
+        }
+
+        // a record left incomplete by an interrupted append is dropped first,
+        // which takes a scan of the whole journal, a complete one is only
+        // checked by its trailer
+        auto file_size= fs::file_size(archive);
+        if (!journal_tail_complete(archive, file_size)) {
+            ifstream file(archive, ios::binary);
+            string data(file_size, '\0');
+            file.read(data.data(), data.length());
+            auto [segments, committed]= journal_records(data.data(), data.length());
+            if (!file || segments.empty()) {
+                throw runtime_error("minitar: " + archive.u8string() + " is not a journal archive");
+            }
+            fs::resize_file(archive, committed);
+            file_size= committed;
+        }
+
+        // the segment reaches the disk before the trailer that commits it
+        write_file(archive, file_size, segment);
+        write_file(archive, file_size + segment.length(), trailer);
+    }
+
+    using index_entries= vector<pair<string, archive::entry>>;
+
+    void index_archive(tar const & tar, string const & prefix, uint64_t & offset, touche_headers & sizes,
+            index_entries & index, uint64_t & index_size) {
+        for (auto const & element: tar) {
+            auto path= prefix + element_name(element);
+            archive::entry entry{&element, 0, 0};
+            if (auto dir= get_if<mkdir>(&element)) {
+                index_archive(dir->children, path + "/", offset, sizes, index, index_size);
+            } else if (holds_alternative<touch>(element)) {
+                entry.offset= offset;
+                entry.size= sizes.front();
+                sizes.pop_front();
+                offset+= entry.size;
+            }
+            index_size+= path.length() + sizeof(entry) + sizeof(element) + 4 * sizeof(void*);
+            index.emplace_back(move(path), entry);
+        }
+    }
+
+    bool archive::index(void const * data) {
+        auto skeleton= scan_header(data, size_);
+        if (!skeleton.has_value()) {
+            return false;
+        }
+        auto const & records= skeleton->records;
+        auto base= static_cast<uint8_t const *>(data);
+
+        // the scan tells where every top level entry starts and how much
+        // content precedes it, so the subtrees are decoded and indexed in
+        // parallel, then spliced in order
+        vector<size_t> roots;
+        for (size_t i= 0; i < records.size(); i++) {
+            if (records[i].parent == no_parent) {
+                roots.push_back(i);
+            }
+        }
+        size_t const per_part= 4096;
+        auto part_count= max<size_t>(1, min<size_t>(roots.size(), records.size() / per_part));
+        vector<v1::tar> parts(part_count);
+        vector<index_entries> entries(part_count);
+        vector<uint64_t> sizes(part_count, 0);
+        parallel_for(part_count, part_count, [&](size_t part) {
+            auto first= roots.size() * part / part_count;
+            auto last= roots.size() * (part + 1) / part_count;
+            if (first == last) {
+                return;
+            }
+            touche_headers touches;
+            for (auto i= first; i < last; i++) {
+                auto const & record= records[roots[i]];
+                read_record(record.action, parts[part], touches, base + record.offset + 1, skeleton->version);
+            }
+            auto offset= skeleton->contents + records[roots[first]].contents_before;
+            index_archive(parts[part], "", offset, touches, entries[part], sizes[part]);
+        });
+
+        index_.reserve(records.size());
+        for (size_t part= 0; part < part_count; part++) {
+            header_.splice(header_.end(), parts[part]);
+            for (auto & [path, entry]: entries[part]) {
+                auto [slot, added]= index_.emplace(move(path), entry);
+                if (added && holds_alternative<touch>(*slot->second.node)) {
+                    files_.push_back(&slot->second);
+                }
+            }
+            index_size_+= sizes[part];
+        }
+        return true;
+    }
+
+    shared_ptr<archive const> archive::open(fs::path path, access mode) {
+        shared_ptr<archive> opened(new archive());
+#if defined(MINITAR_POSIX)
+        fd_guard fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            throw posix_error("open", path);
+        }
+        struct stat st;
+        if (fstat(fd.get(), &st) != 0) {
+            throw posix_error("stat", path);
+        }
+        if (static_cast<uint64_t>(st.st_size) <= magic.length()) {
+            return nullptr;
+        }
+        auto data= mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (data == MAP_FAILED) {
+            throw posix_error("mmap", path);
+        }
+        opened->data_= data;
+        opened->size_= st.st_size;
+        opened->mapped_= true;
+        if (mode == access::positional) {
+            // the header is indexed through a transient mapping, so only its
+            // pages are read, then the contents are left to pread
+            auto indexed= opened->index(opened->data_);
+            munmap(data, st.st_size);
+            opened->data_= nullptr;
+            opened->mapped_= false;
+            if (!indexed) {
+                return nullptr;
+            }
+            opened->mode_= access::positional;
+            opened->fd_= fd.release();
+            return opened;
+        }
+#else
+        // the archive is buffered in memory whatever mode is asked for
+        auto ifs= ifstream(path, ios::binary);
+        if (!ifs) {
+            throw fs::filesystem_error("open", path, make_error_code(errc::io_error));
+        }
+        stringstream buf;
+        buf << ifs.rdbuf();
+        opened->buffer_= buf.str();
+        if (opened->buffer_.length() <= magic.length()) {
+            return nullptr;
+        }
+        opened->data_= opened->buffer_.data();
+        opened->size_= opened->buffer_.length();
+#endif
+        if (!opened->index(opened->data_)) {
+            return nullptr;
+        }
+        return opened;
+    }
+
+    archive::~archive() {
+#if defined(MINITAR_POSIX)
+        if (mapped_) {
+            munmap(const_cast<void*>(data_), size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
+    }
+
+    archive::entry const * archive::find(string const & path) const {
+        auto found= index_.find(path);
+        return found == index_.end() ? nullptr : &found->second;
+    }
+
+    string_view archive::content(entry const & entry) const {
+        if (data_ == nullptr) {
+            throw logic_error("minitar: content views need an archive opened with access::mapped");
+        }
+        return string_view(static_cast<char const *>(data_) + entry.offset, entry.size);
+    }
+
+    optional<string_view> archive::content(string const & path) const {
+        optional<string_view> empty;
+        auto entry= find(path);
+        if (entry == nullptr || !holds_alternative<touch>(*entry->node)) {
+            return empty;
+        }
+        return content(*entry);
+    }
+
+    uint64_t archive::read(entry const & entry, void * buf, uint64_t size, uint64_t offset) const {
+        if (offset >= entry.size) {
+            return 0;
+        }
+        size= min(size, entry.size - offset);
+        if (data_ != nullptr) {
+            memcpy(buf, static_cast<char const *>(data_) + entry.offset + offset, size);
+            return size;
+        }
+#if defined(MINITAR_POSIX)
+        // pread keeps no file position, so threads never step on each other
+        auto ptr= static_cast<char*>(buf);
+        uint64_t done= 0;
+        while (done < size) {
+            auto got= pread(fd_, ptr + done, size - done, entry.offset + offset + done);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw fs::filesystem_error("pread", error_code(errno, generic_category()));
+            }
+            if (got == 0) {
+                break;
+            }
+            done+= got;
+        }
+        return done;
+#else
+        return 0;
+#endif
+    }
+
+    string archive::read(entry const & entry) const {
+        string content(entry.size, '\0');
+        content.resize(read(entry, content.data(), entry.size));
+        return content;
+    }
+
+    uint64_t archive::memory_size() const {
+        return (data_ != nullptr ? size_ : 0) + index_size_;
+    }
+
+    archive_cache::archive_cache(uint64_t memory_budget) : budget_(memory_budget) {}
+
+    shared_ptr<archive const> archive_cache::get(fs::path const & path) {
+        auto mtime= fs::last_write_time(path);
+        auto key= path.u8string();
+        {
+            lock_guard<mutex> guard(lock_);
+            auto found= slots_.find(key);
+            if (found != slots_.end() && found->second->second.mtime == mtime) {
+                lru_.splice(lru_.begin(), lru_, found->second);
+                return found->second->second.opened;
+            }
+        }
+
+        // opened out of the lock, a concurrent miss on the same archive maps
+        // it twice and the last one is kept
+        auto opened= archive::open(path);
+        if (!opened) {
+            return nullptr;
+        }
+
+        lock_guard<mutex> guard(lock_);
+        auto found= slots_.find(key);
+        if (found != slots_.end()) {
+            used_-= found->second->second.opened->memory_size();
+            lru_.erase(found->second);
+            slots_.erase(found);
+        }
+        lru_.emplace_front(key, slot{mtime, opened});
+        slots_[key]= lru_.begin();
+        used_+= opened->memory_size();
+        evict();
+        return opened;
+    }
+
+    void archive_cache::evict() {
+        // the most recent archive is kept even when it exceeds the budget alone
+        while (used_ > budget_ && lru_.size() > 1) {
+            auto & [key, slot]= lru_.back();
+            used_-= slot.opened->memory_size();
+            slots_.erase(key);
+            lru_.pop_back();
+        }
+    }
+
+    void archive_cache::clear() {
+        lock_guard<mutex> guard(lock_);
+        slots_.clear();
+        lru_.clear();
+        used_= 0;
+    }
+
+    uint64_t archive_cache::memory_size() const {
+        lock_guard<mutex> guard(lock_);
+        return used_;
+    }
+
+#if defined(MINITAR_POSIX)
+    // a writer thread fed through a bounded number of fixed-size buffers: the
+    // producer fills the next buffer while the previous ones are written, and
+    // waits when all of them are in flight, or when too many files wait for
+    // their then, as each of them holds an open fd
+    class chunk_writer {
+    public:
+        static constexpr size_t chunk_size= 1 << 20;
+
+        chunk_writer(size_t buffers, size_t files) : buffers_(buffers), files_(files), worker_(&chunk_writer::run, this) {}
+        chunk_writer(chunk_writer const &)= delete;
+        chunk_writer & operator=(chunk_writer const &)= delete;
+        ~chunk_writer() {
+            try {
+                finish();
+            } catch (...) {
+                // already thrown to the producer, or lost with its own error
+            }
+        }
+
+        // a buffer of chunk_size bytes, rethrows the error of a failed write
+        vector<char> acquire() {
+            unique_lock<mutex> guard(lock_);
+            changed_.wait(guard, [this] { return (in_flight_ < buffers_ && pending_ < files_) || error_; });
+            if (error_) {
+                rethrow_exception(error_);
+            }
+            in_flight_++;
+            if (free_.empty()) {
+                return vector<char>(chunk_size);
+            }
+            auto buffer= move(free_.back());
+            free_.pop_back();
+            return buffer;
+        }
+
+        // writes the first size bytes of an acquired buffer to fd
+        void write(int fd, vector<char> && buffer, size_t size, fs::path const & path) {
+            push(job{fd, move(buffer), size, path, nullptr});
+        }
+
+        // runs action once the writes queued before are done, even if one
+        // of them failed, so that it can close their file; waits while too
+        // many files are queued, but never throws, the file must be closed
+        void then(function<void()> && action) {
+            {
+                unique_lock<mutex> guard(lock_);
+                changed_.wait(guard, [this] { return pending_ < files_ || error_; });
+                pending_++;
+            }
+            push(job{-1, {}, 0, {}, move(action)});
+        }
+
+        // the buffers in flight and the files queued
+        size_t backlog() {
+            lock_guard<mutex> guard(lock_);
+            return in_flight_ + pending_;
+        }
+
+        // waits for the queued jobs, rethrows the error of a failed write
+        void finish() {
+            {
+                lock_guard<mutex> guard(lock_);
+                done_= true;
+            }
+            changed_.notify_all();
+            if (worker_.joinable()) {
+                worker_.join();
+            }
+            if (error_) {
+                rethrow_exception(exchange(error_, nullptr));
+            }
+        }
+
+    private:
+        struct job {
+            int fd;
+            vector<char> buffer;
+            size_t size;
+            fs::path path;
+            function<void()> action;
+        };
+
+        void push(job && job) {
+            {
+                lock_guard<mutex> guard(lock_);
+                jobs_.push_back(move(job));
+            }
+            changed_.notify_all();
+        }
+
+        void run() {
+            unique_lock<mutex> guard(lock_);
+            while (true) {
+                changed_.wait(guard, [this] { return !jobs_.empty() || done_; });
+                if (jobs_.empty()) {
+                    return;
+                }
+                auto job= move(jobs_.front());
+                jobs_.pop_front();
+                auto failed= static_cast<bool>(error_);
+                guard.unlock();
+                try {
+                    if (job.action) {
+                        job.action();
+                    } else if (!failed) {
+                        write_fd_data(job.fd, job.buffer.data(), job.size, job.path);
+                    }
+                } catch (...) {
+                    guard.lock();
+                    if (!error_) {
+                        error_= current_exception();
+                    }
+                    guard.unlock();
+                }
+                guard.lock();
+                if (job.action) {
+                    pending_--;
+                } else {
+                    in_flight_--;
+                    free_.push_back(move(job.buffer));
+                }
+                changed_.notify_all();
+            }
+        }
+
+        size_t buffers_;
+        size_t files_;
+        size_t in_flight_= 0;
+        size_t pending_= 0;
+        vector<vector<char>> free_;
+        deque<job> jobs_;
+        bool done_= false;
+        exception_ptr error_;
+        mutex lock_;
+        condition_variable changed_;
+        thread worker_;
+    };
+
+    // enough to keep both sides busy, reading one chunk while writing another
+    size_t const pipeline_buffers= 4;
+
+    // the files all the writers may hold open: a quarter of the fds the
+    // process may open, the rest is left to the caller
+    size_t pipeline_files() {
+        size_t const most= 256;
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+            return most;
+        }
+        return clamp<size_t>(limit.rlim_cur / 4, 1, most);
+    }
+
+    // the waits of the lock-free queues: spins first, then yields, then
+    // sleeps, as a stage may wait on a slower one for long
+    class backoff {
+    public:
+        // true once the wait no longer spins
+        bool pause() {
+            if (rounds_ >= 256) {
+                this_thread::sleep_for(chrono::microseconds(100));
+            } else if (rounds_ >= 16) {
+                this_thread::yield();
+            }
+            return ++rounds_ > 16;
+        }
+
+    private:
+        unsigned rounds_= 0;
+    };
+
+    // a bounded single producer single consumer ring, each side only
+    // stores its own index
+    template<typename T, size_t Capacity>
+    class spsc_ring {
+    public:
+        // value is left untouched when the ring is full
+        bool try_push(T & value) {
+            auto tail= tail_.load(memory_order_relaxed);
+            auto next= (tail + 1) % slots_.size();
+            if (next == head_.load(memory_order_acquire)) {
+                return false;
+            }
+            slots_[tail]= move(value);
+            tail_.store(next, memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T & value) {
+            auto head= head_.load(memory_order_relaxed);
+            if (head == tail_.load(memory_order_acquire)) {
+                return false;
+            }
+            value= move(slots_[head]);
+            head_.store((head + 1) % slots_.size(), memory_order_release);
+            return true;
+        }
+
+    private:
+        array<T, Capacity + 1> slots_;
+        atomic<size_t> head_= 0;
+        atomic<size_t> tail_= 0;
+    };
+
+    // the stages of pack, each one on its own threads:
+    //   walker   walks the tree and queues the files found, then encodes the
+    //            header once their sizes are all known
+    //   readers  claim the queued files in order and read them by chunks
+    //   writer   writes the header, then the chunks of the files in turn,
+    //            gathering the small ones into one writev
+    // the queued files form a lock-free list, each file hands its chunks to
+    // the writer through a lock-free ring, and the chunks read ahead of the
+    // writer are bounded by a byte budget, which the file being written
+    // ignores so that it always progresses; the list itself is not bounded,
+    // the writer waits for the whole walk, but its files hold no fd, the
+    // readers reopen their directories
+    class pack_pipeline {
+    public:
+        static constexpr size_t chunk_size= 1 << 20;
+        static constexpr uint64_t budget= 64 << 20;
+
+        pack_pipeline(fs::path const & root, read_options const & options, int out, fs::path const & archive)
+            : root_(root), options_(options), out_(out), archive_(archive) {}
+
+        void run() {
+            auto readers= max<size_t>(options_.threads ? options_.threads : thread::hardware_concurrency(), 1);
+            vector<thread> stages;
+            try {
+                stages.emplace_back([this] { stage(&pack_pipeline::walk); });
+                for (size_t i= 0; i < readers; i++) {
+                    stages.emplace_back([this] { stage(&pack_pipeline::read); });
+                }
+            } catch (...) {
+                fail(current_exception());
+            }
+            stage(&pack_pipeline::write);
+            for (auto & stage: stages) {
+                stage.join();
+            }
+            if (error_) {
+                rethrow_exception(error_);
+            }
+        }
+
+    private:
+        struct file_job {
+            file_job(shared_ptr<walked_dir const> const & dir, string const & name, uint64_t size, uint64_t seq)
+                : dir(dir), name(name), size(size), seq(seq) {}
+
+            shared_ptr<walked_dir const> dir; // released once read
+            string name;
+            uint64_t size;
+            uint64_t seq;
+            spsc_ring<vector<char>, 4> chunks;
+            atomic<file_job *> next= nullptr;
+        };
+
+        void stage(void (pack_pipeline::*run)()) {
+            try {
+                (this->*run)();
+            } catch (...) {
+                fail(current_exception());
+            }
+        }
+
+        void fail(exception_ptr error) {
+            lock_guard<mutex> guard(error_lock_);
+            if (!error_) {
+                error_= error;
+            }
+            failed_.store(true);
+        }
+
+        void walk() {
+            deferred_contents deferred;
+            file_job * tail= &head_;
+            deferred.found= [this, &tail](touch const & touch, shared_ptr<walked_dir const> const & dir, uint64_t size) {
+                if (failed_.load(memory_order_relaxed)) {
+                    throw runtime_error("minitar: pack aborted");
+                }
+                auto & job= jobs_.emplace_back(dir, touch.name, size, tail->seq + 1);
+                tail->next.store(&job, memory_order_release);
+                tail= &job;
+            };
+            auto tar= read_fs_tree_aux(root_, options_, &deferred);
+            if (options_.reproducible) {
+                // the walk was sorted, the order of the files stays the same
+                normalize(tar);
+            }
+            // without contents, the marshaled size is the one of the header
+            header_.resize(marshal_size(tar));
+            touche_contents contents;
+            write_header(tar, contents, header_.data(), &deferred.sizes);
+            encoded_.store(true, memory_order_release);
+        }
+
+        void read() {
+            // the queued files hold no fd, their directories are reopened
+            dir_opener dirs(root_);
+            backoff idle;
+            auto claimed= claim_.load(memory_order_acquire);
+            while (!failed_.load(memory_order_relaxed)) {
+                auto next= claimed->next.load(memory_order_acquire);
+                if (next == nullptr) {
+                    // the list is complete once the header is encoded
+                    if (encoded_.load(memory_order_acquire) && claimed->next.load(memory_order_acquire) == nullptr) {
+                        return;
+                    }
+                    idle.pause();
+                    claimed= claim_.load(memory_order_acquire);
+                    continue;
+                }
+                // claimed is reloaded on failure, the files are claimed in order
+                if (claim_.compare_exchange_weak(claimed, next, memory_order_acq_rel)) {
+                    read_file(dirs, *next);
+                    claimed= next;
+                }
+            }
+        }
+
+        void read_file(dir_opener & dirs, file_job & job) {
+            auto dir= move(job.dir);
+            fd_guard fd(openat(dirs.open_dir(dir), job.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            if (fd.get() < 0) {
+                throw posix_error("open", dir->path / fs::u8path(job.name));
+            }
+            // the header already tells the size, a file changed since it was
+            // walked is cut or padded with zeros to keep the archive consistent
+            for (auto remain= job.size; remain > 0; ) {
+                auto size= static_cast<size_t>(min<uint64_t>(remain, chunk_size));
+                if (!reserve(job, size)) {
+                    return;
+                }
+                vector<char> chunk(size);
+                auto filled= read_fd_data(fd.get(), chunk.data(), size, dir->path / fs::u8path(job.name));
+                fill(chunk.begin() + filled, chunk.end(), '\0');
+                backoff full;
+                while (!job.chunks.try_push(chunk)) {
+                    if (failed_.load(memory_order_relaxed)) {
+                        return;
+                    }
+                    full.pause();
+                }
+                remain-= size;
+            }
+        }
+
+        bool reserve(file_job const & job, uint64_t size) {
+            backoff over;
+            auto held= buffered_.load(memory_order_relaxed);
+            while (!failed_.load(memory_order_relaxed)) {
+                if (held + size <= budget || writing_.load(memory_order_acquire) == job.seq) {
+                    if (buffered_.compare_exchange_weak(held, held + size, memory_order_relaxed)) {
+                        return true;
+                    }
+                    continue;
+                }
+                over.pause();
+                held= buffered_.load(memory_order_relaxed);
+            }
+            return false;
+        }
+
+        void write() {
+            backoff walking;
+            while (!encoded_.load(memory_order_acquire)) {
+                if (failed_.load(memory_order_relaxed)) {
+                    return;
+                }
+                walking.pause();
+            }
+            write_fd_data(out_, header_.data(), header_.size(), archive_);
+            vector<char>().swap(header_);
+
+            vector<vector<char>> chunks;
+            vector<iovec> pieces;
+            uint64_t gathered= 0;
+            auto flush= [&]() {
+                writev_all(out_, pieces);
+                buffered_.fetch_sub(gathered, memory_order_relaxed);
+                chunks.clear();
+                pieces.clear();
+                gathered= 0;
+            };
+            for (auto job= head_.next.load(memory_order_acquire); job != nullptr; job= job->next.load(memory_order_acquire)) {
+                writing_.store(job->seq, memory_order_release);
+                backoff empty;
+                for (uint64_t done= 0; done < job->size; ) {
+                    vector<char> chunk;
+                    if (!job->chunks.try_pop(chunk)) {
+                        if (failed_.load(memory_order_relaxed)) {
+                            return;
+                        }
+                        // the readers are behind, what is gathered goes out
+                        // meanwhile
+                        if (empty.pause() && !pieces.empty()) {
+                            flush();
+                        }
+                        continue;
+                    }
+                    done+= chunk.size();
+                    gathered+= chunk.size();
+                    pieces.push_back({chunk.data(), chunk.size()});
+                    chunks.push_back(move(chunk));
+                    if (gathered >= chunk_size || pieces.size() >= IOV_MAX) {
+                        flush();
+                    }
+                }
+            }
+            flush();
+        }
+
+        fs::path root_;
+        read_options options_;
+        int out_;
+        fs::path archive_;
+
+        file_job head_{nullptr, "", 0, 0};  // the files follow, from seq 1
+        deque<file_job> jobs_;              // owned by the walker, stable
+        atomic<file_job *> claim_= &head_;  // the last file claimed
+        vector<char> header_;
+        atomic<bool> encoded_= false;
+        atomic<uint64_t> writing_= 0;       // seq of the file being written
+        atomic<uint64_t> buffered_= 0;      // bytes read, not yet written
+
+        atomic<bool> failed_= false;
+        exception_ptr error_;
+        mutex error_lock_;
+    };
+
+    bool pack(fs::path root, fs::path archive, read_options const & options) {
+        if (!fs::is_directory(root)) {
+            return false;
+        }
+        fd_guard out(open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (out.get() < 0) {
+            throw posix_error("open", archive);
+        }
+        pack_pipeline(root, options, out.get(), archive).run();
+        return true;
+    }
+
+    // sequential reads of a file or a pipe through a buffer, large reads go
+    // straight to their destination
+    class stream_source {
+    public:
+        static constexpr size_t buffer_size= 1 << 20;
+
+        explicit stream_source(int fd) : fd_(fd), buffer_(buffer_size) {}
+
+        char const * data() const { return buffer_.data() + begin_; }
+        size_t available() const { return end_ - begin_; }
+        uint64_t position() const { return consumed_; }
+
+        void consume(size_t size) {
+            begin_+= size;
+            consumed_+= size;
+        }
+
+        // buffers at least size bytes, false if the stream ends before
+        bool fill(size_t size) {
+            if (buffer_.size() - begin_ < size) {
+                move(buffer_.begin() + begin_, buffer_.begin() + end_, buffer_.begin());
+                end_-= begin_;
+                begin_= 0;
+                if (buffer_.size() < size) {
+                    buffer_.resize(size);
+                }
+            }
+            while (available() < size) {
+                auto got= read_some(buffer_.data() + end_, buffer_.size() - end_);
+                if (got == 0) {
+                    return false;
+                }
+                end_+= got;
+            }
+            return true;
+        }
+
+        // buffers what one read returns, growing the buffer when it is full,
+        // false at the end of the stream
+        bool fill_some() {
+            if (end_ == buffer_.size()) {
+                if (begin_ > 0) {
+                    move(buffer_.begin() + begin_, buffer_.begin() + end_, buffer_.begin());
+                    end_-= begin_;
+                    begin_= 0;
+                } else {
+                    buffer_.resize(buffer_.size() * 2);
+                }
+            }
+            auto got= read_some(buffer_.data() + end_, buffer_.size() - end_);
+            end_+= got;
+            return got > 0;
+        }
+
+        // false if the stream ends before size bytes
+        bool read(char * data, uint64_t size) {
+            auto buffered= static_cast<size_t>(min<uint64_t>(size, available()));
+            copy(this->data(), this->data() + buffered, data);
+            consume(buffered);
+            data+= buffered;
+            size-= buffered;
+            if (size >= buffer_size) {
+                for (; size > 0; ) {
+                    auto got= read_some(data, size);
+                    if (got == 0) {
+                        return false;
+                    }
+                    consumed_+= got;
+                    data+= got;
+                    size-= got;
+                }
+                return true;
+            }
+            if (size > 0) {
+                if (!fill(size)) {
+                    return false;
+                }
+                copy(this->data(), this->data() + size, data);
+                consume(size);
+            }
+            return true;
+        }
+
+        bool skip(uint64_t size) {
+            while (size > 0) {
+                auto skipped= static_cast<size_t>(min<uint64_t>(size, available()));
+                consume(skipped);
+                size-= skipped;
+                if (size > 0 && !fill(1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        size_t read_some(char * data, size_t size) {
+            while (true) {
+                auto got= ::read(fd_, data, size);
+                if (got >= 0) {
+                    return got;
+                }
+                if (errno != EINTR) {
+                    throw fs::filesystem_error("read", error_code(errno, generic_category()));
+                }
+            }
+        }
+
+        int fd_;
+        vector<char> buffer_;
+        size_t begin_= 0;
+        size_t end_= 0;
+        uint64_t consumed_= 0;
+    };
+
+    using content_spans= unordered_map<touch const *, pair<uint64_t, uint64_t>>;
+
+    // offset and size of every content, after the header
+    void content_spans_of(tar const & tar, touche_headers & sizes, uint64_t & offset, content_spans & spans) {
+        for (auto const & element: tar) {
+            if (auto dir= get_if<mkdir>(&element)) {
+                content_spans_of(dir->children, sizes, offset, spans);
+            } else if (auto file= get_if<touch>(&element)) {
+                spans.emplace(file, pair(offset, sizes.front()));
+                offset+= sizes.front();
+                sizes.pop_front();
+            }
+        }
+    }
+
+    bool unpack(int fd, fs::path root, bool overwrite) {
+        // the header is scanned as it arrives and decoded as soon as it is
+        // complete, a corrupted one is refused without reading further
+        stream_source source(fd);
+        header_scanner scanner;
+        auto scanned= scanner.scan(source.data(), source.available());
+        while (scanned == header_scanner::result::truncated) {
+            if (!source.fill_some()) {
+                return false;
+            }
+            scanned= scanner.scan(source.data(), source.available());
+        }
+        if (scanned == header_scanner::result::corrupt) {
+            return false;
+        }
+        auto const & skeleton= scanner.skeleton();
+        auto [header, end, sizes]= read_header(source.data()).value();
+        source.consume(skeleton.contents);
+        content_spans spans;
+        uint64_t offset= skeleton.contents;
+        content_spans_of(header, sizes, offset, spans);
+
+        // every file goes to the least busy writer, whose buffers bound the
+        // memory in use, and whose queued files the fds open
+        vector<unique_ptr<chunk_writer>> writers(max(thread::hardware_concurrency(), 1u));
+        auto files= max<size_t>(pipeline_files() / writers.size(), 1);
+        for (auto & writer: writers) {
+            writer= make_unique<chunk_writer>(pipeline_buffers, files);
+        }
+        write_policy policy(overwrite);
+        policy.write_content= [&source, &spans, &writers](int fd, touch const & touch, fs::path const & path) {
+            auto & writer= **min_element(writers.begin(), writers.end(), [](auto const & a, auto const & b) {
+                return a->backlog() < b->backlog();
+            });
+            // fd is closed by the writer thread, after the writes queued on it
+            try {
+                // the files are extracted in the order of their contents, the
+                // ones kept on disk are skipped over
+                auto [offset, size]= spans.at(&touch);
+                if (!source.skip(offset - source.position())) {
+                    throw fs::filesystem_error("read", path, make_error_code(errc::io_error));
+                }
+                for (uint64_t done= 0; done < size; ) {
+                    auto buffer= writer.acquire();
+                    auto chunk= static_cast<size_t>(min<uint64_t>(size - done, buffer.size()));
+                    if (!source.read(buffer.data(), chunk)) {
+                        throw fs::filesystem_error("read", path, make_error_code(errc::io_error));
+                    }
+                    writer.write(fd, move(buffer), chunk, path);
+                    done+= chunk;
+                }
+            } catch (...) {
+                writer.then([fd]() { close(fd); });
+                throw;
+            }
+            // the metadata goes after the content, the writes would bump the mtime
+            writer.then([fd, &touch]() {
+                fd_guard file(fd);
+                apply_file_metadata(file.get(), touch);
+            });
+        };
+        write_fs_tree_aux(header, root, policy);
+        for (auto & writer: writers) {
+            writer->finish();
+        }
+        return true;
+    }
+
+    bool unpack(fs::path archive, fs::path root, bool overwrite) {
+        fd_guard fd(open(archive.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            throw posix_error("open", archive);
+        }
+        return unpack(fd.get(), root, overwrite);
+    }
+#endif
+
+}
@@ -11,6 +11,7 @@
 #ifndef _ORG_SMAJI_MINITAR_HPP
 #define _ORG_SMAJI_MINITAR_HPP
 
+#include <cstdint>
 #include <string>
 #include <list>
 #include <variant>
@@ -18,6 +19,15 @@
 #include <filesystem>
 #include <tuple>
 #include <functional>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#endif
 
 namespace minitar {
 
@@ -70,16 +80,27 @@ namespace minitar {
 
         struct mkdir;
 
+        // extended metadata, stored in format version 2
+        struct metadata {
+            int64_t mtime_sec= 0;
+            uint32_t mtime_nsec= 0;
+            uint32_t uid= 0;
+            uint32_t gid= 0;
+            std::list<std::pair<std::string, std::string>> xattrs;
+        };
+
         struct touch {
             std::string name;
             std::filesystem::perms perm;
             std::string content;
+            std::optional<metadata> meta;
         };
 
         struct slink {
             std::string name;
             std::filesystem::perms perm;
             std::string target;
+            std::optional<metadata> meta;
         };
 
         using element= std::variant<
@@ -94,23 +115,191 @@ namespace minitar {
             std::string name;
             std::filesystem::perms perm;
             tar children;
+            std::optional<metadata> meta;
         };
 
+        struct read_options {
+            bool metadata= false; // mtime, uid and gid
+            bool xattrs= false;   // extended attributes, implies metadata
+            bool reproducible= false; // normalize the tree, see below
+            uint32_t threads= 0;  // file reading workers, 0 for one per core
+        };
+
+        // marshal, unmarshal and the functions below share no state, they
+        // are safe to call from several threads on distinct data
         size_t marshal_size(tar const & tar);
 
         void marshal(tar const & tar, void* data);
+
+#if defined(__unix__) || defined(__APPLE__)
+        using iovec= ::iovec;
+#else
+        struct iovec {
+            void * iov_base;
+            size_t iov_len;
+        };
+#endif
+
+        // an archive as a gather list for writev: the encoded header, then
+        // pointers to the contents of the tar, which must outlive it; the
+        // header is a vector so that moving a marshaled keeps the pointers
+        struct marshaled {
+            std::vector<char> header;
+            std::vector<iovec> pieces;
+        };
+
+        marshaled marshal_iov(tar const & tar);
+#if defined(__unix__) || defined(__APPLE__)
+        // writes every piece, in batches of IOV_MAX, resuming partial writes
+        void writev_all(int fd, std::vector<iovec> const & pieces);
+#endif
         std::optional<std::pair<tar, void const *>> unmarshal(void const * data);
 
+        // a chunked archive is a manifest listing the sizes of independently
+        // decodable segments, each one a complete archive, so the segments
+        // are encoded, stored and extracted separately and concurrently
+        std::vector<tar> split(tar tar, uint64_t segment_size);
+        std::vector<std::string> marshal_segments(tar tar, uint64_t segment_size);
+        std::string marshal_manifest(std::vector<std::string> const & segments);
+        std::optional<std::pair<std::vector<uint64_t>, void const *>> unmarshal_manifest(void const * data);
+        void write_segments(std::vector<void const *> const & segments, std::filesystem::path root, bool overwrite= true);
+
+        // a journal archive is a sequence of records, a segment followed by a
+        // trailer holding its size. append only adds a record at the end, so
+        // an interrupted append loses nothing but its own record, which the
+        // next append drops. entries of a later segment override the earlier
+        // ones of the same path
+        void append(std::filesystem::path archive, tar const & tar);
+        std::optional<tar> unmarshal_journal(void const * data, uint64_t size);
+        void merge(tar & into, tar && from);
+
         template<typename stream>
         void stream_marshal(std::optional<tar> const & tar, StreamWriter<stream> & writer);
         template<typename stream>
         std::optional<tar> stream_unmarshal(StreamReader<stream> & reader);
 
         std::optional<tar> read_fs_tree(std::filesystem::path root);
+        std::optional<tar> read_fs_tree(std::filesystem::path root, read_options const & options);
         void write_fs_tree(tar & tar, std::filesystem::path root, bool overwrite= true);
         void write_fs_tree(tar & tar, std::filesystem::path root, std::function<bool(std::filesystem::path const & path, std::string const & content)> const & overwrite);
+        // extracts like write_fs_tree with overwrite, but leaves in place the
+        // files already holding their content, so that re-extracting a mostly
+        // unchanged tree barely writes: the size and the mtime are compared
+        // when the archive has metadata with different mtimes, the size and
+        // the content otherwise, as for a normalized archive whose entries
+        // all have the same mtime. their permission and metadata are still
+        // applied
+        void sync_fs_tree(tar const & tar, std::filesystem::path root);
+
+        // sort the entries by name and normalize the permissions (0755 for
+        // directories and executables, 0644 otherwise) and the metadata (owned
+        // by 0:0, modified at mtime), so that identical trees marshal to
+        // identical bytes
+        void normalize(tar & tar, int64_t mtime= 0);
 
         void print_tar(tar & tar, uint16_t level= 0);
+
+        // a read-only marshaled archive, the header is decoded once into an
+        // index and the contents are left in the file.
+        //
+        // an archive is immutable once opened: every member function is const
+        // and takes no lock, so one shared instance serves any number of
+        // threads reading in parallel
+        class archive {
+        public:
+            enum class access {
+                mapped,     // contents are views of one shared mapping
+                positional, // contents are read with pread, nothing stays mapped
+            };
+
+            struct entry {
+                element const * node;    // in header(), without content
+                uint64_t offset;         // of the content in the archive
+                uint64_t size;
+            };
+
+            // nullptr if the file is not an archive
+            static std::shared_ptr<archive const> open(std::filesystem::path path, access mode= access::mapped);
+
+            archive(archive const &)= delete;
+            archive & operator=(archive const &)= delete;
+            ~archive();
+
+            tar const & header() const { return header_; }
+            // path relative to the archive root, components separated by '/'
+            entry const * find(std::string const & path) const;
+            // views into the mapping, access::mapped only
+            std::string_view content(entry const & entry) const;
+            std::optional<std::string_view> content(std::string const & path) const;
+            // copies up to size bytes of the content from offset into buf,
+            // returns the number of bytes copied; works in both modes
+            uint64_t read(entry const & entry, void * buf, uint64_t size, uint64_t offset= 0) const;
+            std::string read(entry const & entry) const;
+            // the files, in the order of their contents in the archive
+            std::vector<entry const *> const & files() const { return files_; }
+            access mode() const { return mode_; }
+            // mapped bytes and index, what the archive costs to keep open
+            uint64_t memory_size() const;
+
+        private:
+            archive()= default;
+            bool index(void const * contents);
+
+            access mode_= access::mapped;
+            void const * data_= nullptr;
+            uint64_t size_= 0;
+            bool mapped_= false;
+            int fd_= -1; // access::positional
+            std::string buffer_; // holds the archive when it can't be mapped
+            tar header_;
+            std::unordered_map<std::string, entry> index_;
+            std::vector<entry const *> files_;
+            uint64_t index_size_= 0;
+        };
+
+        // a bounded LRU of opened archives keyed by path and mtime, evicting
+        // by memory budget; an evicted archive stays alive as long as someone
+        // holds it
+        class archive_cache {
+        public:
+            explicit archive_cache(uint64_t memory_budget);
+
+            // nullptr if the file is not an archive
+            std::shared_ptr<archive const> get(std::filesystem::path const & path);
+            void clear();
+            uint64_t memory_size() const;
+
+        private:
+            struct slot {
+                std::filesystem::file_time_type mtime;
+                std::shared_ptr<archive const> opened;
+            };
+            using lru= std::list<std::pair<std::string, slot>>;
+
+            void evict();
+
+            uint64_t budget_;
+            uint64_t used_= 0;
+            lru lru_; // most recently used first
+            std::unordered_map<std::string, lru::iterator> slots_;
+            mutable std::mutex lock_;
+        };
+
+#if defined(__unix__) || defined(__APPLE__)
+        // a directory packed into an archive file, and an archive file
+        // unpacked into a directory, without holding the contents in memory.
+        // pack runs as a pipeline: a walker, options.threads readers (one
+        // per core by default) and the writer overlap, the contents read
+        // ahead of the writer being bounded. unpack decodes the header as
+        // soon as it is read, then hands every content, as it arrives, to one
+        // of the writer threads (one per core) through a few fixed-size
+        // buffers each.
+        // false if root is not a directory, or if archive is not an archive
+        bool pack(std::filesystem::path root, std::filesystem::path archive, read_options const & options= read_options());
+        bool unpack(std::filesystem::path archive, std::filesystem::path root, bool overwrite= true);
+        // the archive is read sequentially from fd, a pipe as well as a file
+        bool unpack(int fd, std::filesystem::path root, bool overwrite= true);
+#endif
     }
 
     using tar= std::variant<v1::tar>;
@@ -0,0 +1,223 @@
+/*
+ * minitar_mount.cpp
+ * -----------------
+ * Copyright : (c) 2023 - 2024, ZAN DoYe <zandoye@gmail.com>
+ * Licence   : MIT
+ *
+ * This file is a part of minitar.
+ */
+
+
+#define FUSE_USE_VERSION 31
+
+#include "minitar.hpp"
+#include <fuse.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace std;
+using namespace minitar::v1;
+namespace v1= minitar::v1;
+
+namespace {
+    namespace fs= filesystem;
+
+    // the archive is read-only and never changes while mounted, every
+    // lookup is a hash lookup in its index and every read a copy out of the
+    // mapped file
+    struct mount_state {
+        shared_ptr<archive const> opened;
+        struct stat root;
+    };
+
+    mount_state & state() {
+        return *static_cast<mount_state*>(fuse_get_context()->private_data);
+    }
+
+    archive::entry const * lookup(char const * path) {
+        // fuse paths are absolute, the index is relative to the archive root
+        return state().opened->find(path + 1);
+    }
+
+    // a directory is linked from its parent, from itself and from every
+    // subdirectory, tools like find rely on it
+    nlink_t nlink_of(tar const & children) {
+        nlink_t links= 2;
+        for (auto const & element: children) {
+            links+= holds_alternative<v1::mkdir>(element);
+        }
+        return links;
+    }
+
+    // the blocks du counts, as if the content were on disk
+    blkcnt_t blocks_of(uint64_t size) {
+        return (size + 511) / 512;
+    }
+
+    void fill_stat(archive::entry const & entry, struct stat * st) {
+        auto const & root= state().root;
+        auto apply_meta= [st, &root](optional<metadata> const & meta) {
+            st->st_uid= meta.has_value() ? meta->uid : root.st_uid;
+            st->st_gid= meta.has_value() ? meta->gid : root.st_gid;
+            if (meta.has_value()) {
+                st->st_mtim= { static_cast<time_t>(meta->mtime_sec), static_cast<long>(meta->mtime_nsec) };
+            } else {
+                st->st_mtim= root.st_mtim;
+            }
+            st->st_atim= st->st_mtim;
+            st->st_ctim= st->st_mtim;
+        };
+
+        memset(st, 0, sizeof(*st));
+        if (auto dir= get_if<v1::mkdir>(entry.node)) {
+            st->st_mode= S_IFDIR | static_cast<mode_t>(dir->perm);
+            st->st_nlink= nlink_of(dir->children);
+            apply_meta(dir->meta);
+        } else if (auto file= get_if<touch>(entry.node)) {
+            st->st_mode= S_IFREG | static_cast<mode_t>(file->perm);
+            st->st_nlink= 1;
+            st->st_size= entry.size;
+            st->st_blocks= blocks_of(entry.size);
+            apply_meta(file->meta);
+        } else if (auto link= get_if<slink>(entry.node)) {
+            st->st_mode= S_IFLNK | 0777;
+            st->st_nlink= 1;
+            st->st_size= link->target.length();
+            st->st_blocks= blocks_of(link->target.length());
+            apply_meta(link->meta);
+        }
+    }
+
+    void* mount_init(fuse_conn_info *, fuse_config * config) {
+        // nothing ever changes under the mount, let the kernel cache it all
+        config->kernel_cache= 1;
+        config->entry_timeout= 86400;
+        config->attr_timeout= 86400;
+        config->negative_timeout= 86400;
+        return fuse_get_context()->private_data;
+    }
+
+    int mount_getattr(char const * path, struct stat * st, fuse_file_info *) {
+        if (strcmp(path, "/") == 0) {
+            *st= state().root;
+            return 0;
+        }
+        auto entry= lookup(path);
+        if (entry == nullptr) {
+            return -ENOENT;
+        }
+        fill_stat(*entry, st);
+        return 0;
+    }
+
+    int mount_readdir(char const * path, void * buf, fuse_fill_dir_t filler, off_t, fuse_file_info *, fuse_readdir_flags) {
+        tar const * children= &state().opened->header();
+        if (strcmp(path, "/") != 0) {
+            auto entry= lookup(path);
+            if (entry == nullptr) {
+                return -ENOENT;
+            }
+            auto dir= get_if<v1::mkdir>(entry->node);
+            if (dir == nullptr) {
+                return -ENOTDIR;
+            }
+            children= &dir->children;
+        }
+        filler(buf, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+        filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+        for (auto const & element: *children) {
+            auto const & name= visit([](auto const & entry) -> string const & { return entry.name; }, element);
+            if (filler(buf, name.c_str(), nullptr, 0, static_cast<fuse_fill_dir_flags>(0)) != 0) {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    int mount_open(char const * path, fuse_file_info * info) {
+        auto entry= lookup(path);
+        if (entry == nullptr) {
+            return -ENOENT;
+        }
+        if (!holds_alternative<touch>(*entry->node)) {
+            return -EISDIR;
+        }
+        if ((info->flags & O_ACCMODE) != O_RDONLY) {
+            return -EROFS;
+        }
+        // reads go straight to the entry without another lookup
+        info->fh= reinterpret_cast<uint64_t>(entry);
+        info->keep_cache= 1;
+        return 0;
+    }
+
+    int mount_read(char const *, char * buf, size_t size, off_t offset, fuse_file_info * info) {
+        auto entry= reinterpret_cast<archive::entry const *>(info->fh);
+        auto content= state().opened->content(*entry);
+        if (offset < 0 || static_cast<uint64_t>(offset) >= content.length()) {
+            return 0;
+        }
+        // only the requested range of the mapping is touched
+        auto len= min<uint64_t>(size, content.length() - offset);
+        memcpy(buf, content.data() + offset, len);
+        return len;
+    }
+
+    int mount_readlink(char const * path, char * buf, size_t size) {
+        auto entry= lookup(path);
+        if (entry == nullptr) {
+            return -ENOENT;
+        }
+        auto link= get_if<slink>(entry->node);
+        if (link == nullptr) {
+            return -EINVAL;
+        }
+        if (size == 0) {
+            return 0;
+        }
+        auto len= min<size_t>(size - 1, link->target.length());
+        memcpy(buf, link->target.data(), len);
+        buf[len]= '\0';
+        return 0;
+    }
+}
+
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " archive mountpoint [fuse options]" << endl;
+        return 1;
+    }
+
+    mount_state mounted;
+    try {
+        mounted.opened= archive::open(argv[1]);
+    } catch (fs::filesystem_error const & error) {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    if (!mounted.opened) {
+        cerr << argv[1] << " is not a minitar archive" << endl;
+        return 1;
+    }
+    stat(argv[1], &mounted.root);
+    mounted.root.st_mode= S_IFDIR | 0755;
+    mounted.root.st_nlink= nlink_of(mounted.opened->header());
+    mounted.root.st_size= 0;
+    mounted.root.st_blocks= 0;
+
+    fuse_operations operations;
+    memset(&operations, 0, sizeof(operations));
+    operations.init= mount_init;
+    operations.getattr= mount_getattr;
+    operations.readdir= mount_readdir;
+    operations.open= mount_open;
+    operations.read= mount_read;
+    operations.readlink= mount_readlink;
+
+    // the archive argument is ours, the rest belongs to fuse
+    argv[1]= argv[0];
+    return fuse_main(argc - 1, argv + 1, &operations, &mounted);
+}